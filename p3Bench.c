@@ -0,0 +1,830 @@
+/*
+ * Dhruv Butani - Heap Allocator - UW Madison CS354
+ *
+ * Benchmark and trace replay harness for alloc() and free_block():
+ *
+ *   gcc -O2 -DP3HEAP_64BIT -pthread p3Heap.c p3Bench.c -o p3bench -lm
+ *   ./p3bench [options] uniform|powerlaw|lifo|fifo|prodcons
+ *   ./p3bench [options] replay trace.txt
+ *
+ * Options:
+ *   -n ops      operations per thread (default 1000000)
+ *   -t threads  number of threads (default 1, prodcons uses pairs)
+ *   -s slots    objects live at once (default 4096)
+ *   -m bytes    largest request size
+ *               (default 4096, 1048576 for powerlaw)
+ *   -p policy   good, first, next or best (default good)
+ *   -i ops      ops between footprint samples (default ops / 20)
+ *
+ * Workloads:
+ *   uniform   each op frees or allocates a random slot, sizes uniform
+ *   powerlaw  as uniform, sizes follow a power law (many small, few large)
+ *   lifo      allocates all slots, then frees them newest first
+ *   fifo      allocates all slots, then frees them oldest first
+ *   prodcons  half the threads allocate and pass blocks to the other half,
+ *             which free them
+ *   replay    runs the alloc/free/realloc calls of a trace file
+ *
+ * Trace files are either binary traces written by heap_trace_start(), or
+ * text with one call per line, pointers in hex, sizes in decimal:
+ *   a <ptr> <size>          ptr = alloc(size)
+ *   f <ptr>                 free_block(ptr)
+ *   r <old> <ptr> <size>    ptr = realloc_block(old, size)
+ * Anything after these fields, and lines starting with '#', are ignored.
+ *
+ * Every alloc and free is timed on its own, so ns/op includes the cost of
+ * one clock read.  The harness' own memory comes from the C library.
+ */
+
+#define _GNU_SOURCE
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "p3Heap.h"
+
+#define MAX_THREADS 64
+#define MAX_SAMPLES 1000
+
+/*
+ * Latency histogram: values below 8 ns have a bucket each, above that
+ * every power of two is split into 8 buckets, like the size classes.
+ */
+#define LAT_SUB      8
+#define LAT_BUCKETS  (62 * LAT_SUB)
+
+/* Settings from the command line. */
+typedef struct benchConfig {
+    const char *workload;
+    const char *trace;
+    size_t ops;
+    int threads;
+    size_t slots;
+    size_t max_size;
+    placementPolicy placement;
+    size_t interval;
+} benchConfig;
+
+/* State of one benchmark thread. */
+typedef struct benchThread {
+    int id;
+    pthread_t thread;
+    uint64_t rng;
+    size_t ops;                     // alloc and free calls made
+    size_t failed;                  // allocs that returned NULL
+    _Atomic long live;              // bytes requested and not freed yet
+    size_t hist[LAT_BUCKETS];
+    char pad[64];
+} benchThread;
+
+/* Footprint sample taken every config.interval ops by thread 0. */
+typedef struct benchSample {
+    double seconds;
+    size_t ops;
+    long live;
+    size_t footprint;
+    double fragmentation;
+} benchSample;
+
+/* Call of a replayed trace, pointers resolved to slot numbers. */
+typedef struct traceOp {
+    char op;                        // 'a', 'f' or 'r'
+    size_t slot;
+    size_t old_slot;                // slot freed by 'r'
+    size_t size;
+} traceOp;
+
+/* Blocks passed from a producer to its consumer. */
+#define RING_SIZE 1024
+
+typedef struct benchRing {
+    _Atomic size_t head;            // next slot the consumer reads
+    char pad1[64];
+    _Atomic size_t tail;            // next slot the producer writes
+    char pad2[64];
+    void *ptr[RING_SIZE];
+    size_t size[RING_SIZE];
+    _Atomic int done;
+} benchRing;
+
+static benchConfig config;
+static benchThread threads[MAX_THREADS];
+static benchRing rings[MAX_THREADS / 2];
+static pthread_barrier_t start_barrier;
+static uint64_t start_ns;
+
+static benchSample samples[MAX_SAMPLES];
+static int num_samples;
+static size_t peak_footprint;
+static long peak_live;
+
+static traceOp *trace_ops;
+static size_t trace_len;
+static size_t trace_slots;
+
+/* Returns the time of a monotonic clock in nanoseconds. */
+static uint64_t now_ns() {
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* xorshift64*, returns the next pseudo random number of 't'. */
+static uint64_t next_random(benchThread *t) {
+
+    t->rng ^= t->rng >> 12;
+    t->rng ^= t->rng << 25;
+    t->rng ^= t->rng >> 27;
+    return t->rng * 2685821657736338717ULL;
+}
+
+/* Returns the histogram bucket for a latency of 'ns'. */
+static int lat_bucket(uint64_t ns) {
+
+    if (ns < LAT_SUB) {
+        return ns;
+    }
+
+    int fl = 63 - __builtin_clzll(ns);
+    int sl = (ns >> (fl - 3)) & (LAT_SUB - 1);
+    int bucket = (fl - 2) * LAT_SUB + sl;
+
+    return bucket < LAT_BUCKETS ? bucket : LAT_BUCKETS - 1;
+}
+
+/* Returns the smallest latency in histogram bucket 'bucket'. */
+static uint64_t lat_value(int bucket) {
+
+    if (bucket < LAT_SUB) {
+        return bucket;
+    }
+
+    int fl = bucket / LAT_SUB + 2;
+    int sl = bucket % LAT_SUB;
+
+    return ((uint64_t)1 << fl) + ((uint64_t)sl << (fl - 3));
+}
+
+/* Returns a request size for workload 'config.workload'. */
+static size_t random_size(benchThread *t) {
+
+    uint64_t r = next_random(t);
+
+    if (strcmp(config.workload, "powerlaw") == 0) {
+        // Pareto with alpha 1.2 starting at 16 bytes.
+        double u = ((r >> 11) + 1) * (1.0 / 9007199254740992.0);
+        double size = 16.0 / pow(u, 1.0 / 1.2);
+
+        return size < config.max_size ? (size_t)size : config.max_size;
+    }
+    return 1 + r % config.max_size;
+}
+
+/* Samples the footprint of the heap, called by thread 0 only. */
+static void take_sample(size_t ops) {
+
+    heapStats stats;
+    long live = 0;
+
+    heap_stats(&stats);
+    for (int i = 0; i < config.threads; i++) {
+        live += atomic_load_explicit(&threads[i].live, memory_order_relaxed);
+    }
+
+    size_t footprint = stats.heap_bytes + stats.large_bytes;
+
+    if (footprint > peak_footprint) {
+        peak_footprint = footprint;
+    }
+    if (live > peak_live) {
+        peak_live = live;
+    }
+
+    if (num_samples < MAX_SAMPLES) {
+        benchSample *s = &samples[num_samples++];
+
+        s->seconds = (now_ns() - start_ns) / 1e9;
+        s->ops = ops;
+        s->live = live;
+        s->footprint = footprint;
+        s->fragmentation = stats.fragmentation;
+    }
+}
+
+/* Timed alloc() of 'size' bytes by thread 't'. */
+static void* timed_alloc(benchThread *t, size_t size) {
+
+    uint64_t start = now_ns();
+    void *ptr = alloc(size);
+
+    t->hist[lat_bucket(now_ns() - start)]++;
+    t->ops++;
+
+    if (ptr == NULL) {
+        t->failed++;
+    } else {
+        atomic_fetch_add_explicit(&t->live, size, memory_order_relaxed);
+    }
+    if (t->id == 0 && t->ops % config.interval == 0) {
+        take_sample(t->ops);
+    }
+    return ptr;
+}
+
+/* Timed free_block() of 'ptr', a block of 'size' bytes, by thread 't'. */
+static void timed_free(benchThread *t, void *ptr, size_t size) {
+
+    uint64_t start = now_ns();
+
+    free_block(ptr);
+
+    t->hist[lat_bucket(now_ns() - start)]++;
+    t->ops++;
+
+    atomic_fetch_sub_explicit(&t->live, size, memory_order_relaxed);
+    if (t->id == 0 && t->ops % config.interval == 0) {
+        take_sample(t->ops);
+    }
+}
+
+/* uniform and powerlaw: random frees and allocations over the slots. */
+static void run_random(benchThread *t) {
+
+    void **ptr = calloc(config.slots, sizeof(void*));
+    size_t *size = calloc(config.slots, sizeof(size_t));
+
+    while (t->ops < config.ops) {
+        size_t slot = next_random(t) % config.slots;
+
+        if (ptr[slot] != NULL) {
+            timed_free(t, ptr[slot], size[slot]);
+            ptr[slot] = NULL;
+        } else {
+            size[slot] = random_size(t);
+            ptr[slot] = timed_alloc(t, size[slot]);
+        }
+    }
+
+    for (size_t i = 0; i < config.slots; i++) {
+        if (ptr[i] != NULL) {
+            free_block(ptr[i]);
+            atomic_fetch_sub_explicit(&t->live, size[i], memory_order_relaxed);
+        }
+    }
+    free(ptr);
+    free(size);
+}
+
+/* lifo and fifo: fills every slot, then frees them in order. */
+static void run_batch(benchThread *t, int lifo) {
+
+    void **ptr = calloc(config.slots, sizeof(void*));
+    size_t *size = calloc(config.slots, sizeof(size_t));
+
+    while (t->ops < config.ops) {
+        for (size_t i = 0; i < config.slots; i++) {
+            size[i] = random_size(t);
+            ptr[i] = timed_alloc(t, size[i]);
+        }
+        for (size_t i = 0; i < config.slots; i++) {
+            size_t slot = lifo ? config.slots - 1 - i : i;
+
+            if (ptr[slot] != NULL) {
+                timed_free(t, ptr[slot], size[slot]);
+            }
+        }
+    }
+    free(ptr);
+    free(size);
+}
+
+/* prodcons, producer side: allocates and passes blocks on. */
+static void run_producer(benchThread *t, benchRing *ring) {
+
+    while (t->ops < config.ops) {
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+        while (tail - atomic_load_explicit(&ring->head, memory_order_acquire) == RING_SIZE) {
+            sched_yield();
+        }
+
+        size_t size = random_size(t);
+        void *ptr = timed_alloc(t, size);
+
+        if (ptr == NULL) {
+            continue;
+        }
+
+        // The consumer's free is accounted to the producer's live bytes.
+        ring->ptr[tail % RING_SIZE] = ptr;
+        ring->size[tail % RING_SIZE] = size;
+        atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    }
+    atomic_store_explicit(&ring->done, 1, memory_order_release);
+}
+
+/* prodcons, consumer side: frees the blocks of its producer. */
+static void run_consumer(benchThread *t, benchThread *producer, benchRing *ring) {
+
+    for (;;) {
+        size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+        if (head == atomic_load_explicit(&ring->tail, memory_order_acquire)) {
+            if (atomic_load_explicit(&ring->done, memory_order_acquire) &&
+                head == atomic_load_explicit(&ring->tail, memory_order_acquire)) {
+                break;
+            }
+            sched_yield();
+            continue;
+        }
+
+        void *ptr = ring->ptr[head % RING_SIZE];
+        size_t size = ring->size[head % RING_SIZE];
+
+        atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+        timed_free(t, ptr, 0);
+        atomic_fetch_sub_explicit(&producer->live, size, memory_order_relaxed);
+    }
+}
+
+/* replay: runs the calls of the trace on thread 0. */
+static void run_replay(benchThread *t) {
+
+    void **ptr = calloc(trace_slots, sizeof(void*));
+    size_t *size = calloc(trace_slots, sizeof(size_t));
+
+    for (size_t i = 0; i < trace_len; i++) {
+        traceOp *op = &trace_ops[i];
+
+        if (op->op == 'a') {
+            size[op->slot] = op->size;
+            ptr[op->slot] = timed_alloc(t, op->size);
+        } else if (op->op == 'f') {
+            if (ptr[op->slot] != NULL) {
+                timed_free(t, ptr[op->slot], size[op->slot]);
+            }
+            ptr[op->slot] = NULL;
+        } else {
+            uint64_t start = now_ns();
+            void *moved = realloc_block(ptr[op->old_slot], op->size);
+
+            t->hist[lat_bucket(now_ns() - start)]++;
+            t->ops++;
+            atomic_fetch_add_explicit(&t->live, (long)op->size - (long)size[op->old_slot],
+                                      memory_order_relaxed);
+            if (t->id == 0 && t->ops % config.interval == 0) {
+                take_sample(t->ops);
+            }
+
+            ptr[op->old_slot] = NULL;
+            ptr[op->slot] = moved;
+            size[op->slot] = op->size;
+        }
+    }
+
+    for (size_t i = 0; i < trace_slots; i++) {
+        if (ptr[i] != NULL) {
+            free_block(ptr[i]);
+        }
+    }
+    free(ptr);
+    free(size);
+}
+
+static void* bench_thread(void *arg) {
+
+    benchThread *t = (benchThread*)arg;
+
+    pthread_barrier_wait(&start_barrier);
+
+    if (strcmp(config.workload, "uniform") == 0 || strcmp(config.workload, "powerlaw") == 0) {
+        run_random(t);
+    } else if (strcmp(config.workload, "lifo") == 0) {
+        run_batch(t, 1);
+    } else if (strcmp(config.workload, "fifo") == 0) {
+        run_batch(t, 0);
+    } else if (strcmp(config.workload, "prodcons") == 0) {
+        if (t->id % 2 == 0) {
+            run_producer(t, &rings[t->id / 2]);
+        } else {
+            run_consumer(t, &threads[t->id - 1], &rings[t->id / 2]);
+        }
+    } else {
+        run_replay(t);
+    }
+    return NULL;
+}
+
+/*
+ * Live pointers of a trace and their slots, with open addressing.
+ * Keys are never 0, removed keys are UINT64_MAX.
+ */
+typedef struct traceMap {
+    uint64_t *keys;
+    size_t *slots;
+    size_t capacity;                // power of two
+    size_t count;                   // keys in use or removed
+    size_t *free_slots;             // slots of freed pointers, for reuse
+    size_t num_free;
+} traceMap;
+
+/* Returns the index of 'key' in 'map', or of the empty entry to add it. */
+static size_t map_find(traceMap *map, uint64_t key) {
+
+    size_t i = (key * 11400714819323198485ULL) >> 7 & (map->capacity - 1);
+
+    while (map->keys[i] != 0 && map->keys[i] != key) {
+        i = (i + 1) & (map->capacity - 1);
+    }
+    return i;
+}
+
+/* Rebuilds 'map' with twice the capacity, dropping removed keys. */
+static void map_grow(traceMap *map) {
+
+    traceMap old = *map;
+
+    map->capacity = old.capacity ? 2 * old.capacity : 1024;
+    map->keys = calloc(map->capacity, sizeof(uint64_t));
+    map->slots = calloc(map->capacity, sizeof(size_t));
+    map->count = 0;
+
+    for (size_t i = 0; i < old.capacity; i++) {
+        if (old.keys[i] != 0 && old.keys[i] != UINT64_MAX) {
+            size_t j = map_find(map, old.keys[i]);
+
+            map->keys[j] = old.keys[i];
+            map->slots[j] = old.slots[i];
+            map->count++;
+        }
+    }
+    free(old.keys);
+    free(old.slots);
+}
+
+/*
+ * Returns the slot of 'key', adding it with a new slot if 'add' is set,
+ * or removing it and freeing its slot if not.
+ * Returns SIZE_MAX if 'key' is not live and 'add' is not set.
+ */
+static size_t map_slot(traceMap *map, uint64_t key, int add) {
+
+    if (add) {
+        if (2 * (map->count + 1) > map->capacity) {
+            map_grow(map);
+        }
+
+        size_t i = map_find(map, key);
+
+        if (map->keys[i] != key) {
+            map->keys[i] = key;
+            map->count++;
+            map->slots[i] = map->num_free ? map->free_slots[--map->num_free] : trace_slots++;
+        }
+        return map->slots[i];
+    }
+
+    if (map->capacity == 0) {
+        return SIZE_MAX;
+    }
+
+    size_t i = map_find(map, key);
+
+    if (map->keys[i] != key) {
+        return SIZE_MAX;
+    }
+
+    // Removed keys are marked, so searches still run past them.
+    size_t slot = map->slots[i];
+
+    map->keys[i] = UINT64_MAX;
+    map->free_slots = realloc(map->free_slots, (map->num_free + 1) * sizeof(size_t));
+    map->free_slots[map->num_free++] = slot;
+    return slot;
+}
+
+/*
+ * Adds call 'op' on trace pointers 'ptr' and 'old' to trace_ops.
+ * Frees and reallocs of pointers that are not live, and failed calls,
+ * are dropped.
+ */
+static void add_call(traceMap *map, char op, uint64_t ptr, uint64_t old, size_t size) {
+
+    static size_t capacity;
+    traceOp call;
+
+    memset(&call, 0, sizeof(call));
+    call.op = op;
+    call.size = size;
+
+    if (op == 'a') {
+        if (ptr == 0) {
+            return;
+        }
+        call.slot = map_slot(map, ptr, 1);
+    } else if (op == 'f') {
+        call.slot = map_slot(map, ptr, 0);
+        if (call.slot == SIZE_MAX) {
+            return;
+        }
+    } else {
+        call.old_slot = map_slot(map, old, 0);
+        if (call.old_slot == SIZE_MAX || ptr == 0) {
+            return;
+        }
+        call.slot = map_slot(map, ptr, 1);
+    }
+
+    if (trace_len == capacity) {
+        capacity = capacity ? 2 * capacity : 4096;
+        trace_ops = realloc(trace_ops, capacity * sizeof(traceOp));
+    }
+    trace_ops[trace_len++] = call;
+}
+
+static heapTraceRecord *sort_records;
+
+/* Orders indexes of sort_records by time, then by place in the file. */
+static int compare_records(const void *a, const void *b) {
+
+    size_t i = *(const size_t*)a, j = *(const size_t*)b;
+
+    if (sort_records[i].time_ns != sort_records[j].time_ns) {
+        return sort_records[i].time_ns < sort_records[j].time_ns ? -1 : 1;
+    }
+    return i < j ? -1 : i > j;
+}
+
+/*
+ * Reads the records of binary trace 'file', written by heap_trace_start(),
+ * into trace_ops in the order of their time stamps.
+ * Returns 0 on success, -1 if the file is not a trace of this version.
+ */
+static int load_binary_trace(FILE *file, traceMap *map) {
+
+    heapTraceHeader header;
+
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        header.version != P3HEAP_TRACE_VERSION ||
+        header.record_size != sizeof(heapTraceRecord)) {
+        return -1;
+    }
+
+    heapTraceRecord *records = NULL;
+    size_t count = 0, capacity = 0;
+
+    for (;;) {
+        if (count == capacity) {
+            capacity = capacity ? 2 * capacity : 4096;
+            records = realloc(records, capacity * sizeof(heapTraceRecord));
+        }
+
+        size_t n = fread(records + count, sizeof(heapTraceRecord), capacity - count, file);
+
+        if (n == 0) {
+            break;
+        }
+        count += n;
+    }
+
+    size_t *order = malloc((count ? count : 1) * sizeof(size_t));
+
+    for (size_t i = 0; i < count; i++) {
+        order[i] = i;
+    }
+    sort_records = records;
+    qsort(order, count, sizeof(size_t), compare_records);
+
+    static const char ops[] = { 0, 'a', 'f', 'r' };
+
+    for (size_t i = 0; i < count; i++) {
+        heapTraceRecord *record = &records[order[i]];
+
+        if (record->op >= 1 && record->op <= 3) {
+            add_call(map, ops[record->op], record->ptr, record->old, record->size);
+        }
+    }
+    free(order);
+    free(records);
+    return 0;
+}
+
+/*
+ * Reads trace file 'path' into trace_ops, a text trace or a binary one
+ * written by heap_trace_start().
+ * Returns 0 on success, -1 if the file cannot be read.
+ */
+static int load_trace(const char *path) {
+
+    FILE *file = fopen(path, "r");
+
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    traceMap map;
+    char line[256];
+    int result = 0;
+
+    memset(&map, 0, sizeof(map));
+
+    if (fread(line, 1, 4, file) == 4 && memcmp(line, P3HEAP_TRACE_MAGIC, 4) == 0) {
+        rewind(file);
+        result = load_binary_trace(file, &map);
+        if (result != 0) {
+            fprintf(stderr, "%s: unsupported trace version\n", path);
+        }
+    } else {
+        rewind(file);
+        while (fgets(line, sizeof(line), file) != NULL) {
+            unsigned long long ptr, old;
+            size_t size;
+
+            if (line[0] == 'a' && sscanf(line + 1, "%llx %zu", &ptr, &size) == 2) {
+                add_call(&map, 'a', ptr, 0, size);
+            } else if (line[0] == 'f' && sscanf(line + 1, "%llx", &ptr) == 1) {
+                add_call(&map, 'f', ptr, 0, 0);
+            } else if (line[0] == 'r' &&
+                       sscanf(line + 1, "%llx %llx %zu", &old, &ptr, &size) == 3) {
+                add_call(&map, 'r', ptr, old, size);
+            }
+        }
+    }
+
+    fclose(file);
+    free(map.keys);
+    free(map.slots);
+    free(map.free_slots);
+    return result;
+}
+
+/* Prints the latency percentiles of all threads together. */
+static void print_latency() {
+
+    static size_t hist[LAT_BUCKETS];
+    size_t total = 0;
+
+    for (int i = 0; i < config.threads; i++) {
+        for (int b = 0; b < LAT_BUCKETS; b++) {
+            hist[b] += threads[i].hist[b];
+            total += threads[i].hist[b];
+        }
+    }
+
+    static const double points[] = { 0.5, 0.9, 0.99, 0.999 };
+    static const char *names[] = { "p50", "p90", "p99", "p99.9" };
+    size_t seen = 0;
+    int next = 0;
+    int last = 0;
+
+    printf("ns/op       ");
+    for (int b = 0; b < LAT_BUCKETS; b++) {
+        seen += hist[b];
+        while (next < 4 && seen >= points[next] * total && total != 0) {
+            printf(" %s %llu", names[next], (unsigned long long)lat_value(b));
+            next++;
+        }
+        if (hist[b] != 0) {
+            last = b;
+        }
+    }
+    printf("  max %llu\n", (unsigned long long)lat_value(last));
+}
+
+static void usage(const char *name) {
+
+    fprintf(stderr, "usage: %s [-n ops] [-t threads] [-s slots] [-m bytes] "
+            "[-p good|first|next|best] [-i ops]\n"
+            "       uniform|powerlaw|lifo|fifo|prodcons|replay trace\n", name);
+    exit(2);
+}
+
+int main(int argc, char *argv[]) {
+
+    static const char *policies[] = { "good", "first", "next", "best" };
+    int opt;
+
+    config.ops = 1000000;
+    config.threads = 1;
+    config.slots = 4096;
+    config.placement = P3HEAP_GOOD_FIT;
+
+    while ((opt = getopt(argc, argv, "n:t:s:m:p:i:")) != -1) {
+        switch (opt) {
+        case 'n': config.ops = strtoull(optarg, NULL, 0); break;
+        case 't': config.threads = atoi(optarg); break;
+        case 's': config.slots = strtoull(optarg, NULL, 0); break;
+        case 'm': config.max_size = strtoull(optarg, NULL, 0); break;
+        case 'i': config.interval = strtoull(optarg, NULL, 0); break;
+        case 'p':
+            for (opt = 0; opt < 4 && strcmp(optarg, policies[opt]) != 0; opt++)
+                ;
+            if (opt == 4) {
+                usage(argv[0]);
+            }
+            config.placement = (placementPolicy)opt;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind >= argc) {
+        usage(argv[0]);
+    }
+    config.workload = argv[optind];
+
+    if (strcmp(config.workload, "replay") == 0) {
+        if (optind + 1 >= argc || load_trace(argv[optind + 1]) != 0) {
+            usage(argv[0]);
+        }
+        config.trace = argv[optind + 1];
+        config.threads = 1;
+        config.ops = trace_len;
+    } else if (strcmp(config.workload, "uniform") != 0 &&
+               strcmp(config.workload, "powerlaw") != 0 &&
+               strcmp(config.workload, "lifo") != 0 &&
+               strcmp(config.workload, "fifo") != 0 &&
+               strcmp(config.workload, "prodcons") != 0) {
+        usage(argv[0]);
+    }
+
+    if (strcmp(config.workload, "prodcons") == 0 && config.threads % 2 != 0) {
+        config.threads++;
+    }
+    if (config.threads < 1 || config.threads > MAX_THREADS || config.slots == 0 ||
+        config.ops == 0) {
+        usage(argv[0]);
+    }
+    if (config.max_size == 0) {
+        config.max_size = strcmp(config.workload, "powerlaw") == 0 ? 1 << 20 : 4096;
+    }
+    if (config.interval == 0) {
+        config.interval = config.ops / 20 ? config.ops / 20 : 1;
+    }
+
+    heapConfig heap;
+
+    heap.initial_size = (size_t)4 << 20;
+    heap.max_size = P3HEAP_DEFAULT_MAX;
+    heap.grow_size = 0;
+    heap.trim_threshold = P3HEAP_DEFAULT_TRIM;
+    heap.mmap_threshold = P3HEAP_DEFAULT_MMAP;
+    heap.placement = config.placement;
+    heap.isolate = 0;
+    heap.pages = P3HEAP_PAGES_NORMAL;
+
+    if (init_heap_ex(&heap) != 0) {
+        return 1;
+    }
+
+    pthread_barrier_init(&start_barrier, NULL, config.threads + 1);
+    for (int i = 0; i < config.threads; i++) {
+        threads[i].id = i;
+        threads[i].rng = 0x9E3779B97F4A7C15ULL * (i + 1);
+        pthread_create(&threads[i].thread, NULL, bench_thread, &threads[i]);
+    }
+
+    start_ns = now_ns();
+    pthread_barrier_wait(&start_barrier);
+
+    for (int i = 0; i < config.threads; i++) {
+        pthread_join(threads[i].thread, NULL);
+    }
+
+    double seconds = (now_ns() - start_ns) / 1e9;
+    size_t ops = 0, failed = 0;
+
+    for (int i = 0; i < config.threads; i++) {
+        ops += threads[i].ops;
+        failed += threads[i].failed;
+    }
+
+    printf("workload    %s%s%s  policy %s  threads %d  ops %zu\n", config.workload,
+           config.trace ? " " : "", config.trace ? config.trace : "",
+           policies[config.placement], config.threads, ops);
+    printf("ops/sec     %.0f\n", ops / seconds);
+    print_latency();
+    printf("peak live   %ld bytes  peak footprint %zu bytes  ratio %.2f\n", peak_live,
+           peak_footprint, peak_live > 0 ? (double)peak_footprint / peak_live : 0.0);
+    if (failed != 0) {
+        printf("failed      %zu allocs\n", failed);
+    }
+
+    printf("\n%10s %12s %14s %14s %8s\n", "seconds", "ops", "live", "footprint", "frag");
+    for (int i = 0; i < num_samples; i++) {
+        printf("%10.3f %12zu %14ld %14zu %8.3f\n", samples[i].seconds, samples[i].ops,
+               samples[i].live, samples[i].footprint, samples[i].fragmentation);
+    }
+    return 0;
+}
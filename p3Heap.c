@@ -3,15 +3,57 @@
  * Copyright 2020-2024 Deb Deppeler based on work by Jim Skrentny
  */
 
+#define _GNU_SOURCE     // mremap()
 #include <unistd.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>       // qsort()
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/file.h>     // flock()
 #include <fcntl.h>
 #include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <stdarg.h>
+#include <sys/syscall.h>
 #include "p3Heap.h"
 
+// Debug mode poisons redzones for AddressSanitizer when built with it,
+// see "Debug mode".
+#ifdef P3HEAP_DEBUG
+#if defined(__SANITIZE_ADDRESS__)
+#define DEBUG_ASAN
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define DEBUG_ASAN
+#endif
+#endif
+#ifdef DEBUG_ASAN
+#include <sanitizer/asan_interface.h>
+#endif
+#endif
+
+/*
+ * Block header word.
+ *
+ * By default headers are 4 bytes and payloads are 8-byte aligned, which
+ * limits one heap to just under 4 GiB.
+ * Building with -DP3HEAP_64BIT makes headers 8 bytes (size_t) and payloads
+ * 16-byte aligned, so a single heap can be as large as the address space.
+ */
+#ifdef P3HEAP_64BIT
+typedef size_t blockWord;
+#define ALIGNMENT 16
+#else
+typedef unsigned int blockWord;
+#define ALIGNMENT 8
+#endif
+
+_Static_assert(ALIGNMENT == P3HEAP_ALIGNMENT, "P3HEAP_ALIGNMENT does not match ALIGNMENT");
+
 /*
  * This structure serves as the header for each allocated and free block.
  * It also serves as the footer for each free block.
@@ -19,7 +61,7 @@
 typedef struct blockHeader {           
 
     /*
-     * 1) The size of each heap block must be a multiple of 8
+     * 1) The size of each heap block must be a multiple of ALIGNMENT
      * 2) heap blocks have blockHeaders that contain size and status bits
      * 3) free heap block contain a footer, but we can use the blockHeader 
      *.
@@ -35,349 +77,5193 @@ typedef struct blockHeader {
      *   Bit1 == 0 => previous block is free
      *   Bit1 == 1 => previous block is allocated
      * 
+     *   Bit2 => third last bit, only set for large blocks
+     *   Bit2 == 1 => block has its own mapping outside of any heap,
+     *                see largeBlock
+     * 
      * Start Heap: 
-     *  The blockHeader for the first block of the heap is after skip 4 bytes.
+     *  The blockHeader for the first block of the heap is after skipping
+     *  one blockHeader worth of bytes (4, or 8 with P3HEAP_64BIT).
      *  This ensures alignment requirements can be met.
      * 
      * End Mark: 
-     *  The end of the available memory is indicated using a size_status of 1.
+     *  The end of the available memory is indicated using a block of size 0
+     *  with the a-bit set, i.e. a size_status of 1, plus its p-bit.
+     *  Its p-bit tells whether the last block of the heap is free.
      * 
      */
-    int size_status;
+    blockWord size_status;
 
 } blockHeader;         
 
-/* Global variable
- * It must point to the first block in the heap and is set by init_heap()
- * i.e., the block at the lowest address.
- */
-blockHeader *heap_start = NULL;     
+#define HEADER_SIZE (sizeof(blockHeader))
+#define WORD_BITS   (8 * sizeof(blockWord))
 
-/* Size of heap allocation padded to round to nearest page size. */
-int alloc_size;
+blockWord aBit = 1;
+blockWord pBit = 2;
+blockWord mBit = 4;
+blockWord sMask = ~(blockWord)7;
 
-unsigned int aBit = 1; 
-unsigned int pBit = 2; 
-unsigned int sMask = ~7; 
+/*
+ * Free blocks are kept on explicit segregated free lists, one list per
+ * size class, so alloc() only has to look at free blocks.
+ *
+ * The links are stored in the payload of each free block, right after
+ * its blockHeader, as offsets from the start of the mapped region
+ * (the bytes skipped before heap_start).  Offset 0 is never a block,
+ * so it is used to mean "no block".
+ *
+ * This makes the smallest block that can ever be freed four words:
+ * header + next + prev + footer.
+ */
+typedef struct freeLinks {
+    blockWord next;   // next free block in the same size class
+    blockWord prev;   // previous free block in the same size class
+} freeLinks;
 
+#define MIN_BLOCK_SIZE (4 * HEADER_SIZE)
 
+/*
+ * Size classes:
+ *  Blocks smaller than 256 bytes get one class per multiple of ALIGNMENT,
+ *  so every block in a small class has the same size.
+ *  Larger blocks are grouped by power of two, and each power of two is split
+ *  into 8 equal sub-ranges.  A class never spans more than 12.5% in size.
+ */
+#define ALIGN_SHIFT      (__builtin_ctz(ALIGNMENT))
+#define LINEAR_SHIFT     8
+#define LINEAR_CLASSES   ((1 << LINEAR_SHIFT) / ALIGNMENT)
+#define SUB_SHIFT        3
+#define SUB_CLASSES      (1 << SUB_SHIFT)
+#define NUM_CLASSES      (LINEAR_CLASSES + (WORD_BITS - LINEAR_SHIFT) * SUB_CLASSES)
 
+/*
+ * Non-empty size classes are tracked in a two-level bitmap: one bit per
+ * class in class_map, and one bit per word of class_map in class_summary
+ * for words that are not zero.  Finding the first non-empty class at or
+ * above a given one takes at most two ctz instructions.
+ */
+#define CLASS_WORDS      ((NUM_CLASSES + 63) / 64)
+_Static_assert(CLASS_WORDS < 64, "class_summary must have a bit per word");
+_Static_assert(NUM_CLASSES <= P3HEAP_SIZE_BUCKETS, "heapProfile.sizes too small");
 
-/* 
- * Function for allocating 'size' bytes of heap memory.
- * Argument size: requested size for the payload
- * Returns address of allocated block (payload) on success.
- * Returns NULL on failure.
+/*
+ * One heap (arena), heap_t in p3Heap.h.
  *
- * - BEST-FIT PLACEMENT POLICY to chose a free block
+ * Each arena owns one mapped region.  The heap_t itself sits at the start
+ * of that region, followed by the blocks and the end mark, so creating an
+ * arena never needs memory from anywhere else.
  *
- * - If the BEST-FIT block that is found is exact size match
- *   - 1. Update all heap blocks as needed for any affected blocks
- *   - 2. Return the address of the allocated block payload
+ * Threads are bound to arenas, see thread_arena().  All block headers and
+ * free lists of an arena are protected by its lock.  Allocations and
+ * frees take the lock of the calling thread's own arena.  A thread that
+ * frees a block of another arena takes no lock: the block is pushed on
+ * that arena's remote_frees stack, and the owner puts it back into the
+ * heap on its next allocation.  realloc_block(), free_batch(), heap_trim(),
+ * the reports (heap_stats(), heap_dump(), heap_check()) and the fork
+ * handlers take the lock of whichever arena owns the blocks they touch.
+ * Heaps from heap_create() are arenas that no thread is bound to.
+ */
+struct heap {
+
+    pthread_mutex_t lock;
+
+    /* Configuration the arena was created with, see heapConfig. */
+    heapConfig config;
+
+    /* Heap file the region is mapped from, see init_heap_file(), or -1. */
+    int fd;
+
+    /*
+     * It must point to the first block in the heap, i.e., the block at
+     * the lowest address.
+     */
+    blockHeader *heap_start;
+
+    /* Size of the heap blocks, from heap_start up to the end mark. */
+    size_t alloc_size;
+
+    /*
+     * Bytes of the mapping that are usable, including this struct.
+     * The rest of the reserved range is mapped PROT_NONE until the heap
+     * grows into it.
+     */
+    size_t map_size;
+
+    /* Size of the whole reserved range, the most map_size can grow to. */
+    size_t reserve_size;
+
+    /*
+     * Granularity the region is committed and released in: the O.S. page
+     * size, or the huge page size when it is backed by huge pages.
+     * The region starts on a multiple of it.
+     */
+    size_t region_page;
+
+    /* Number of threads currently bound to this arena. */
+    int threads;
+
+    /* NUMA node the region is bound to, 0 without NUMA. */
+    int node;
+
+    /* Payloads freed by other threads, linked through their first word. */
+    _Atomic(void*) remote_frees;
+
+    /* Head of the free list for each size class, 0 when the class is empty. */
+    blockWord free_lists[NUM_CLASSES];
+
+    /* Bitmap of the non-empty free lists, see CLASS_WORDS. */
+    uint64_t class_map[CLASS_WORDS];
+    uint64_t class_summary;
+
+    /*
+     * Block where the next P3HEAP_NEXT_FIT search starts, never the end
+     * mark.  When blocks coalesce it moves to the start of the merged block.
+     */
+    blockHeader *rover;
+
+    /*
+     * Last block checked by heap_check_step(), NULL when the next step
+     * starts at heap_start.  Moves like the rover when blocks coalesce.
+     */
+    blockHeader *check_last;
+
+    /*
+     * Counters for heap_stats().  free_bytes and free_blocks cover the
+     * blocks on the free lists, used_blocks every other block.
+     * Calls served without the lock are added later, see tcache.
+     */
+    size_t free_bytes;
+    size_t free_blocks;
+    size_t used_blocks;
+    size_t alloc_calls;
+    size_t free_calls;
+    size_t failed_allocs;
+    size_t splits;
+    size_t coalesces;
+
+    /*
+     * Histograms for heap_profile(), only updated while profiling is on.
+     * Calls of any thread bound to this arena are counted here, so the
+     * counters are only updated with relaxed atomic adds.
+     */
+    heapProfile profile;
+
+};
+
+/*
+ * Record right after the heap_t of every region, only filled in for the
+ * region of a heap file, see init_heap_file().  It identifies the file and
+ * the build that wrote it, and holds the root offset.  The region's blocks
+ * start on the page after it.
+ */
+#define HEAP_FILE_MAGIC   "P3HF"
+#define HEAP_FILE_VERSION 1
+
+typedef struct heapFile {
+    char     magic[4];          // HEAP_FILE_MAGIC, not terminated
+    uint32_t version;           // HEAP_FILE_VERSION
+    uint32_t header_size;       // HEADER_SIZE of the build that wrote it
+    uint32_t arena_size;        // sizeof(heap_t) of that build
+    uint64_t root;              // offset of the root block, 0 for none
+} heapFile;
+
+/* Returns the heapFile record of the region of arena 'h'. */
+static heapFile* file_of(heap_t *h) {
+    return (heapFile*)(h + 1);
+}
+
+/* Bytes at the start of every region used by its heap_t and heapFile. */
+#define REGION_HEADER_SIZE(pagesize) \
+    ((sizeof(heap_t) + sizeof(heapFile) + (pagesize) - 1) / (pagesize) * (pagesize))
+
+/* Upper bound on the number of arenas, threads beyond this share them. */
+#define MAX_ARENAS 64
+
+/*
+ * Arenas created so far, never unmapped.  arenas[0] is created by
+ * init_heap() and the others the first time a new thread allocates.
+ * New arenas are added under arena_lock and published through num_arenas,
+ * so they can be searched without taking a lock.
+ */
+static heap_t *arenas[MAX_ARENAS];
+static atomic_int num_arenas;
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Configuration from init_heap_ex(), used for every arena. */
+static heapConfig heap_config;
+
+/* Page size from the O.S., set by init_heap_ex(). */
+static size_t page_size;
+
+/*
+ * File descriptor of the heap file arenas[0] is mapped from, -1 unless
+ * the heap was set up by init_heap_file() or reopen_heap_file().
+ */
+static int heap_fd = -1;
+
+/* Size of a transparent huge page, see P3HEAP_PAGES_TRANSPARENT. */
+#define THP_PAGE_SIZE ((size_t)2 << 20)
+
+/*
+ * Number of NUMA nodes, set by init_heap_ex().  With more than one, every
+ * arena belongs to the node of the thread that created it and its region
+ * is bound to that node, see create_arena().
+ */
+static int numa_nodes;
+
+/* Highest node a node mask below can name, and mbind()'s preferred policy. */
+#define NUMA_MAX_NODES      64
+#define NUMA_MPOL_PREFERRED 1
+
+/* Arena the calling thread is bound to, NULL until its first call. */
+static __thread heap_t *thread_heap;
+
+/* Unbinds a thread from its arena when the thread exits. */
+static pthread_key_t thread_key;
+
+/*
+ * Thread cache (tcache) of recently freed small blocks.
  *
- * - If the BEST-FIT block that is found is large enough to split 
- *   - 1. SPLIT the free block into two valid heap blocks:
- *         1. an allocated block
- *         2. a free block
- *         NOTE: both blocks must meet heap block requirements 
- *       - Update all heap block header(s) and footer(s) 
- *              as needed for any affected blocks.
- *   - 2. Return the address of the allocated block payload
+ * Blocks of the thread's own arena with a payload of at most
+ * TCACHE_MAX_SIZE bytes are not given back to the heap when freed.
+ * They stay marked allocated in their headers and are pushed on a per-thread
+ * bin for their exact block size instead, linked through their first word.
+ * alloc() pops from the bin before looking at the heap, so a hit touches
+ * neither the arena lock nor any block header.
+ * Each bin holds at most TCACHE_DEPTH blocks, further frees go to the heap.
+ * Blocks of a heap file are never cached: one still marked allocated when
+ * the process exits would be lost for good.
  *
- *   Return if NULL unable to find and allocate block for required size
+ * Calls that never take the arena lock -- cache hits, large blocks and
+ * frees of another arena's blocks -- are counted here and added to the
+ * counters of the thread's arena the next time it takes the lock.
+ */
+#define TCACHE_MAX_SIZE  256
+#define TCACHE_MAX_BLOCK ((TCACHE_MAX_SIZE + HEADER_SIZE + ALIGNMENT - 1) & ~(ALIGNMENT - 1))
+#define TCACHE_BINS      ((TCACHE_MAX_BLOCK / ALIGNMENT) + 1)
+#define TCACHE_DEPTH     16
+
+typedef struct tcache {
+    void *bins[TCACHE_BINS];             // cached payloads, by block size
+    unsigned char counts[TCACHE_BINS];   // number of blocks in each bin
+    size_t allocs;                       // alloc() calls not counted yet
+    size_t frees;                        // free_block() calls not counted yet
+    size_t failures;                     // failed alloc() calls not counted yet
+    unsigned sample_tick;                // calls since the last timed one
+} tcache;
+
+static __thread tcache thread_cache;
+
+/*
+ * Large blocks.
  *
+ * Requests of at least heap_config.mmap_threshold bytes get a mapping of
+ * their own instead of a block in an arena, so they never fragment a heap
+ * and their memory goes straight back to the O.S. when freed.
+ * The mapping starts with a largeBlock, and the payload follows at
+ * LARGE_OFFSET with a blockHeader right before it, like every other block.
+ * That header has the m-bit and a-bit set and no size, so it can never be
+ * mistaken for a heap block or the end mark.
+ * Live large blocks are kept on a list for disp_heap().
  */
-void* alloc(int size) {     
-    
-  
-    int blockSize = size + 4;
-    
-    if (size < 1 || blockSize > alloc_size) {
-        return NULL;
+typedef struct largeBlock {
+    struct largeBlock *next;
+    struct largeBlock *prev;
+    size_t map_size;        // bytes mapped, a multiple of the page size
+} largeBlock;
+
+#define LARGE_OFFSET \
+    ((sizeof(largeBlock) + HEADER_SIZE + ALIGNMENT - 1) & ~(ALIGNMENT - 1))
+
+static largeBlock *large_blocks;
+static size_t large_count;      // number of live large blocks
+static size_t large_bytes;      // bytes mapped for them
+static pthread_mutex_t large_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Profiling, see heap_profile_enable().
+ * 0 when off, otherwise one in this many calls is timed.
+ */
+static unsigned profile_every;
+
+/*
+ * Trace recording, see heap_trace_start().
+ *
+ * Each thread records its calls in a traceRing of its own, without
+ * locking: it is the only writer of head and the flusher thread the only
+ * writer of tail.  The flusher writes new records straight from the ring
+ * to the trace file every TRACE_FLUSH_NS.  A call that finds its ring full
+ * is dropped and counted rather than waiting for the flusher.
+ * Rings are never unmapped.  A thread's ring is given up when it exits
+ * and reused by the next thread that needs one.
+ */
+#define TRACE_RING_SIZE 65536
+#define TRACE_FLUSH_NS  1000000
+
+typedef struct traceRing {
+    struct traceRing *next;         // every ring, see trace_rings
+    atomic_int in_use;              // set while a thread owns the ring
+    uint32_t thread;                // O.S. thread id of the owner
+    _Atomic size_t head;            // records written by the owner
+    char pad1[64];
+    _Atomic size_t tail;            // records written out by the flusher
+    _Atomic size_t dropped;         // records lost to a full ring
+    char pad2[64];
+    heapTraceRecord records[TRACE_RING_SIZE];
+} traceRing;
+
+static _Atomic(traceRing*) trace_rings;
+static __thread traceRing *thread_ring;
+static int tracing;                 // set while recording
+static int trace_fd = -1;
+static int trace_stopping;          // tells the flusher to finish
+static pthread_t trace_thread;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Returns the block size needed for a payload of 'size' bytes,
+ * the size plus its header rounded up to ALIGNMENT.
+ * The caller must make sure 'size' cannot overflow.
+ */
+static size_t block_size_for(size_t size) {
+
+    size_t blockSize = (size + HEADER_SIZE + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1);
+
+    if (blockSize < MIN_BLOCK_SIZE) {
+        blockSize = MIN_BLOCK_SIZE;
     }
+    return blockSize;
+}
 
-    if (blockSize % 8 != 0) {
-        blockSize = (blockSize + 7) & ~7;
+/*
+ * Returns the size class for a block of 'blockSize' bytes.
+ */
+static int size_class(size_t blockSize) {
+
+    if (blockSize < (1 << LINEAR_SHIFT)) {
+        return blockSize >> ALIGN_SHIFT;
     }
 
-    blockHeader *temp = heap_start;
-    int tempSize = (temp->size_status) & sMask;
-    int tempLoc = (temp->size_status) % 8; 
+    int fl = 8 * sizeof(unsigned long) - 1 - __builtin_clzl(blockSize);
+    int sl = (blockSize >> (fl - SUB_SHIFT)) & (SUB_CLASSES - 1);
 
-    
-    blockHeader *bf = heap_start;
-    int bfs = 0;
+    return LINEAR_CLASSES + (fl - LINEAR_SHIFT) * SUB_CLASSES + sl;
+}
+
+/* Converts between a block address and its offset in the mapped region. */
+static blockWord block_offset(heap_t *h, blockHeader *block) {
+    return (char*)block - (char*)(h->heap_start - 1);
+}
+
+static blockHeader* offset_block(heap_t *h, blockWord offset) {
+    if (offset == 0) {
+        return NULL;
+    }
+    return (blockHeader*)((char*)(h->heap_start - 1) + offset);
+}
 
-    blockHeader *nextHeader = (blockHeader*)((char*)temp + tempSize);
+static freeLinks* links_of(blockHeader *block) {
+    return (freeLinks*)(block + 1);
+}
 
-    int exact = 0;
-    int partial = 0;
+/*
+ * Moves the block pointers kept in arena 'h' off block 'gone', which was
+ * merged into the block 'into' right before it.
+ */
+static void block_merged(heap_t *h, blockHeader *gone, blockHeader *into) {
 
-    while(exact == 0 && temp->size_status != 1) {
+    if (h->rover == gone) {
+        h->rover = into;
+    }
+    if (h->check_last == gone) {
+        h->check_last = into;
+    }
+}
 
-        tempLoc = (temp->size_status) % 8; 
-        tempSize = (temp->size_status) & sMask;
-        
-        nextHeader = (blockHeader*)((char*)temp + tempSize);
+/*
+ * Pushes free block 'block' on the front of the list for its size class.
+ * The size in its header must already be set.
+ */
+static void list_insert(heap_t *h, blockHeader *block) {
 
-        
+    int cls = size_class((block->size_status) & sMask);
+    freeLinks *links = links_of(block);
 
-        if (tempLoc == 0 || tempLoc == 2) {
+    links->prev = 0;
+    links->next = h->free_lists[cls];
 
-            if (tempSize > blockSize && (tempSize <= bfs || bfs == 0)) {
-                bf = temp;
-                bfs = (bf->size_status) & sMask;
+    if (h->free_lists[cls] != 0) {
+        links_of(offset_block(h, h->free_lists[cls]))->prev = block_offset(h, block);
+    }
+    h->free_lists[cls] = block_offset(h, block);
 
-                partial = 1;
-            } 
+    h->class_map[cls / 64] |= (uint64_t)1 << (cls % 64);
+    h->class_summary |= (uint64_t)1 << (cls / 64);
 
-            else if (tempSize == blockSize) {
-                exact = 1;
-                bf = temp;
-                bfs = (bf->size_status) & sMask;
-                
-                if (nextHeader->size_status != 1) {
-                    nextHeader->size_status += 2;        
-                }
-                bf->size_status += 1;
+    h->free_bytes += (block->size_status) & sMask;
+    h->free_blocks++;
+}
+
+/*
+ * Unlinks free block 'block' from the list for its size class.
+ * The size in its header must be the size it was inserted with.
+ */
+static void list_remove(heap_t *h, blockHeader *block) {
+
+    int cls = size_class((block->size_status) & sMask);
+    freeLinks *links = links_of(block);
+
+    if (links->prev != 0) {
+        links_of(offset_block(h, links->prev))->next = links->next;
+    } else {
+        h->free_lists[cls] = links->next;
+
+        if (links->next == 0) {
+            h->class_map[cls / 64] &= ~((uint64_t)1 << (cls % 64));
+            if (h->class_map[cls / 64] == 0) {
+                h->class_summary &= ~((uint64_t)1 << (cls / 64));
             }
         }
+    }
 
-        temp = (blockHeader*)((char*)temp + tempSize);
+    if (links->next != 0) {
+        links_of(offset_block(h, links->next))->prev = links->prev;
     }
 
-    if (exact == 0 && partial == 0) {
-        return NULL;
+    h->free_bytes -= (block->size_status) & sMask;
+    h->free_blocks--;
+}
+
+/*
+ * Returns the first size class at or above 'cls' with a free block,
+ * or -1 if there is none.
+ */
+static int next_class(heap_t *h, int cls) {
+
+    if (cls >= (int)NUM_CLASSES) {
+        return -1;
     }
 
-    if (blockSize < bfs && (bfs - blockSize >= 8)) {
-        blockHeader *splitBlock = (blockHeader*)((char*)bf + blockSize);
+    int word = cls / 64;
+    uint64_t bits = h->class_map[word] & (~(uint64_t)0 << (cls % 64));
 
-        int remainder = bfs - blockSize;
-        
-		splitBlock->size_status = remainder + 2; 
-        
-        if (bf == heap_start) { 
-            bf->size_status = blockSize + 3;
-        } 
-        else { 
-            tempLoc = (temp->size_status) % 8 + 1;
-            bf->size_status = blockSize + tempLoc + 1;
+    if (bits == 0) {
+        uint64_t words = h->class_summary & (~(uint64_t)0 << (word + 1));
+
+        if (words == 0) {
+            return -1;
         }
+        word = __builtin_ctzll(words);
+        bits = h->class_map[word];
     }
+    return word * 64 + __builtin_ctzll(bits);
+}
 
-    return bf+1;
+/* Adds one to profiling counter 'counter'. */
+static void profile_add(size_t *counter) {
+    __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+}
 
-} 
+/*
+ * Returns the histogram bucket of 'value' out of 'buckets':
+ * 0 for 0, otherwise i for values in [2^(i-1), 2^i), the last bucket
+ * taking everything above.
+ */
+static int log2_bucket(uint64_t value, int buckets) {
+
+    int bucket = value == 0 ? 0 : 64 - __builtin_clzll(value);
+
+    return bucket < buckets ? bucket : buckets - 1;
+}
 
 /* 
- * Function for freeing up a previously allocated block.
- * Argument ptr: address of the block to be freed up.
- * Returns 0 on success.
- * Returns -1 on failure.
- * This function Will:
- * - Return -1 if ptr is NULL.
- * - Return -1 if ptr is not a multiple of 8.
- * - Return -1 if ptr is outside of the heap space.
- * - Return -1 if ptr block is already freed.
- * - Update header(s) and footer as needed.
+ * Placement policies, each returns a free block of at least 'blockSize'
+ * bytes or NULL, and adds the number of blocks it looked at to 'walked'.
+ * The caller must hold h->lock.
  *
- * If free results in two or more adjacent free blocks,
- * they will be immediately coalesced into one larger free block.
- * so free blocks require a footer (blockHeader works) to store the size
- */                    
-int free_block(void *ptr) {
+ * P3HEAP_GOOD_FIT, in bounded time:
+ *   The first block of the request's size class is taken if it fits,
+ *   which it always does in the small classes where all blocks have the
+ *   same size.  Otherwise every block in a higher class fits, so the first
+ *   block of the first non-empty higher class is taken, found through the
+ *   class bitmap.  The block is never more than one class (12.5%) larger
+ *   than the smallest class that could be used.
+ *   Only if no higher class has a block, the rest of the request's own
+ *   class is searched before giving up.  That walk is the one part that is
+ *   not bounded and only happens when the heap is about to grow.
+ */
+static blockHeader* find_good_fit(heap_t *h, size_t blockSize, unsigned *walked) {
 
-    if((ptr == NULL) || (((int) ptr % 8 != 0))) {
-        return -1;
+    // Blocks in the request's own class may still be too small.
+    int cls = size_class(blockSize);
+    blockHeader *block = offset_block(h, h->free_lists[cls]);
+
+    if (block == NULL || ((block->size_status) & sMask) < blockSize) {
+        int above = next_class(h, cls + 1);
+
+        if (above >= 0) {
+            (*walked)++;
+            return offset_block(h, h->free_lists[above]);
+        }
+
+        // Last resort before the heap has to grow.
+        while (block != NULL && ((block->size_status) & sMask) < blockSize) {
+            (*walked)++;
+            block = offset_block(h, links_of(block)->next);
+        }
     }
+    if (block != NULL) {
+        (*walked)++;
+    }
+    return block;
+}
 
-    if(((int)ptr > ((int)heap_start + alloc_size)) || ((int)ptr < (int)heap_start)) {
-        return -1;
+/*
+ * P3HEAP_FIRST_FIT:
+ *   The request's own size class is searched for the first block that
+ *   fits, otherwise the first block of the first non-empty higher class
+ *   is taken.  Unlike good-fit, a fit in the own class is always preferred
+ *   over a larger block.
+ */
+static blockHeader* find_first_fit(heap_t *h, size_t blockSize, unsigned *walked) {
+
+    int cls = size_class(blockSize);
+    blockHeader *block = offset_block(h, h->free_lists[cls]);
+
+    while (block != NULL && ((block->size_status) & sMask) < blockSize) {
+        (*walked)++;
+        block = offset_block(h, links_of(block)->next);
     }
 
-    blockHeader *header = (blockHeader *) ( (char *) ptr - sizeof(blockHeader));
-    int headerSize = (header->size_status) & sMask;
-    int headerStatus = (header->size_status) & aBit;
+    if (block == NULL) {
+        int above = next_class(h, cls + 1);
 
-    if(headerStatus == 0) {
-        return -1;
+        if (above >= 0) {
+            block = offset_block(h, h->free_lists[above]);
+        }
     }
+    if (block != NULL) {
+        (*walked)++;
+    }
+    return block;
+}
 
-    blockHeader *footer = (blockHeader *) ((char *) header + headerSize - sizeof(blockHeader));
-    footer->size_status = (header->size_status) & sMask;
-    
+/*
+ * P3HEAP_NEXT_FIT:
+ *   The heap is walked in address order from h->rover, wrapping around at
+ *   the end mark, and the first free block that fits is taken.  The rover
+ *   is left right after the allocated block, so the next search picks up
+ *   where this one stopped and allocations spread over the whole heap.
+ */
+static blockHeader* find_next_fit(heap_t *h, size_t blockSize, unsigned *walked) {
 
-    blockHeader *next = (blockHeader *) ((char *) header + headerSize);
+    blockHeader *start = h->rover;
+    blockHeader *block = start;
 
+    do {
+        size_t size = (block->size_status) & sMask;
 
-    header->size_status -=1;
+        if (size == 0) {
+            block = h->heap_start;
+            continue;
+        }
+        (*walked)++;
+        if (((block->size_status) & aBit) == 0 && size >= blockSize) {
+            return block;
+        }
+        block = (blockHeader*)((char*)block + size);
+    } while (block != start);
 
-    if(next->size_status != 1) {
-        (next->size_status) -=2;
-    }
+    return NULL;
+}
 
-    return 0;
-    
-} 
+/*
+ * P3HEAP_BEST_FIT:
+ *   The request's own size class is searched for the closest fit, stopping
+ *   early only at an exact match.  Every block in a higher class fits, so
+ *   otherwise the first non-empty higher class is searched for its
+ *   smallest block.
+ */
+static blockHeader* find_best_fit(heap_t *h, size_t blockSize, unsigned *walked) {
 
-/* 
- * Initializes the memory allocator.
- * Called once by a program.
- * Argument sizeOfRegion: the size of the heap space to be allocated.
- * Returns 0 on success.
- * Returns -1 on failure.
- */                    
-int init_heap(int sizeOfRegion) {    
+    blockHeader *bf = NULL;
+    size_t bfs = 0;
 
-    static int allocated_once = 0; //prevent multiple myInit calls
+    // Blocks in the request's own class may still be too small.
+    int cls = size_class(blockSize);
+    blockHeader *temp = offset_block(h, h->free_lists[cls]);
 
-    int   pagesize; // page size
-    int   padsize;  // size of padding when heap size not a multiple of page size
-    void* mmap_ptr; // pointer to memory mapped area
-    int   fd;
+    while (temp != NULL && bfs != blockSize) {
+        size_t tempSize = (temp->size_status) & sMask;
 
-    blockHeader* end_mark;
+        (*walked)++;
+        if (tempSize >= blockSize && (bfs == 0 || tempSize < bfs)) {
+            bf = temp;
+            bfs = tempSize;
+        }
+        temp = offset_block(h, links_of(temp)->next);
+    }
 
-    if (0 != allocated_once) {
-        fprintf(stderr, 
-                "Error: mem.c: InitHeap has allocated space during a previous call\n");
-        return -1;
+    if (bf != NULL) {
+        return bf;
     }
 
-    if (sizeOfRegion <= 0) {
-        fprintf(stderr, "Error: mem.c: Requested block size is not positive\n");
-        return -1;
+    // Otherwise the first non-empty class above holds the best fit.
+    cls = next_class(h, cls + 1);
+    if (cls < 0) {
+        return NULL;
     }
 
-    // Get the pagesize from O.S. 
-    pagesize = getpagesize();
+    temp = offset_block(h, h->free_lists[cls]);
 
-    // Calculate padsize as the padding required to round up sizeOfRegion 
-    // to a multiple of pagesize
-    padsize = sizeOfRegion % pagesize;
-    padsize = (pagesize - padsize) % pagesize;
+    while (temp != NULL) {
+        size_t tempSize = (temp->size_status) & sMask;
+
+        (*walked)++;
+        if (bfs == 0 || tempSize < bfs) {
+            bf = temp;
+            bfs = tempSize;
+        }
+        temp = offset_block(h, links_of(temp)->next);
+    }
+    return bf;
+}
 
-    alloc_size = sizeOfRegion + padsize;
+/* 
+ * Returns a free block of arena 'h' of at least 'blockSize' bytes, chosen
+ * by h->config.placement, or NULL if there is none.
+ * The caller must hold h->lock.
+ */
+static blockHeader* find_block(heap_t *h, size_t blockSize) {
 
-    // Using mmap to allocate memory
-    fd = open("/dev/zero", O_RDWR);
-    if (-1 == fd) {
-        fprintf(stderr, "Error:mem.c: Cannot open /dev/zero\n");
-        return -1;
+    blockHeader *bf;
+    unsigned walked = 0;
+
+    switch (h->config.placement) {
+    case P3HEAP_FIRST_FIT:
+        bf = find_first_fit(h, blockSize, &walked);
+        break;
+    case P3HEAP_NEXT_FIT:
+        bf = find_next_fit(h, blockSize, &walked);
+        break;
+    case P3HEAP_BEST_FIT:
+        bf = find_best_fit(h, blockSize, &walked);
+        break;
+    default:
+        bf = find_good_fit(h, blockSize, &walked);
+        break;
     }
-    mmap_ptr = mmap(NULL, alloc_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
-    if (MAP_FAILED == mmap_ptr) {
-        fprintf(stderr, "Error:mem.c: mmap cannot allocate space\n");
-        allocated_once = 0;
-        return -1;
+
+    if (__atomic_load_n(&profile_every, __ATOMIC_RELAXED) != 0) {
+        profile_add(&h->profile.walked[log2_bucket(walked, P3HEAP_WALK_BUCKETS)]);
     }
+    return bf;
+}
 
-    allocated_once = 1;
+/*
+ * Allocates the first 'blockSize' bytes of free block 'bf' of arena 'h',
+ * splitting the rest off as a free block if it is large enough.
+ * The caller must hold h->lock.
+ * Returns the address of the payload.
+ */
+static void* take_block(heap_t *h, blockHeader *bf, size_t blockSize) {
 
-    // for double word alignment and end mark
-    alloc_size -= 8;
+    size_t bfs = (bf->size_status) & sMask;
 
-    // Initially there is only one big free block in the heap.
-    // Skip first 4 bytes for double word alignment requirement.
-    heap_start = (blockHeader*) mmap_ptr + 1;
+    list_remove(h, bf);
 
-    // Set the end mark
-    end_mark = (blockHeader*)((void*)heap_start + alloc_size);
-    end_mark->size_status = 1;
+    blockWord pStatus = (bf->size_status) & pBit;
 
-    // Set size in header
-    heap_start->size_status = alloc_size;
+    if (bfs - blockSize >= MIN_BLOCK_SIZE) {
+        blockHeader *splitBlock = (blockHeader*)((char*)bf + blockSize);
 
-    // Set p-bit as allocated in header
-    // note a-bit left at 0 for free
-    heap_start->size_status += 2;
+        size_t remainder = bfs - blockSize;
 
-    // Set the footer
-    blockHeader *footer = (blockHeader*) ((void*)heap_start + alloc_size - 4);
-    footer->size_status = alloc_size;
+        // The remainder follows an allocated block.
+        splitBlock->size_status = remainder + 2;
 
-    return 0;
-} 
+        blockHeader *footer = (blockHeader*)((char*)splitBlock + remainder - HEADER_SIZE);
+        footer->size_status = remainder;
 
-/* 
- * 
- * Prints out a list of all the blocks including this information:
- * No.      : serial number of the block 
- * Status   : free/used (allocated)
- * Prev     : status of previous block free/used (allocated)
- * t_Begin  : address of the first byte in the block (where the header starts) 
- * t_End    : address of the last byte in the block 
- * t_Size   : size of the block as stored in the block header
- */                     
-void disp_heap() {     
+        list_insert(h, splitBlock);
+        h->splits++;
+    } 
+    else {
+        blockSize = bfs;
 
-    int    counter;
-    char   status[6];
-    char   p_status[6];
-    char * t_begin = NULL;
-    char * t_end   = NULL;
-    int    t_size;
+        blockHeader *nextHeader = (blockHeader*)((char*)bf + bfs);
+        nextHeader->size_status |= pBit;
+    }
 
-    blockHeader *current = heap_start;
-    counter = 1;
+    bf->size_status = blockSize + pStatus + 1;
+    h->used_blocks++;
 
-    int used_size =  0;
-    int free_size =  0;
-    int is_used   = -1;
+    // Next-fit carries on after this block.
+    h->rover = (blockHeader*)((char*)bf + blockSize);
+    if (((h->rover->size_status) & sMask) == 0) {
+        h->rover = h->heap_start;
+    }
 
-    fprintf(stdout, 
-            "********************************** HEAP: Block List ****************************\n");
-    fprintf(stdout, "No.\tStatus\tPrev\tt_Begin\t\tt_End\t\tt_Size\n");
-    fprintf(stdout, 
-            "--------------------------------------------------------------------------------\n");
+    return bf+1;
+}
+
+/* 
+ * Function for allocating 'size' bytes of heap memory from arena 'h'.
+ * The caller must hold h->lock.
+ * Argument size: requested size for the payload
+ * Returns address of allocated block (payload) on success.
+ * Returns NULL on failure.
+ *
+ * - PLACEMENT POLICY to chose a free block, h->config.placement
+ *   - see find_good_fit(), find_first_fit(), find_next_fit() and
+ *     find_best_fit().  All of them share the splitting in take_block().
+ *
+ * - If the block that is found is exact size match
+ *   - 1. Update all heap blocks as needed for any affected blocks
+ *   - 2. Return the address of the allocated block payload
+ *
+ * - If the block that is found is large enough to split 
+ *   - 1. SPLIT the free block into two valid heap blocks:
+ *         1. an allocated block
+ *         2. a free block
+ *         NOTE: both blocks must meet heap block requirements 
+ *       - Update all heap block header(s) and footer(s) 
+ *              as needed for any affected blocks.
+ *   - 2. Return the address of the allocated block payload
+ *
+ *   Return if NULL unable to find and allocate block for required size
+ *
+ */
+static void* alloc_block(heap_t *h, size_t size) {
+    
+    if (size < 1 || size > h->alloc_size) {
+        return NULL;
+    }
+
+    size_t blockSize = block_size_for(size);
+
+    if (blockSize > h->alloc_size) {
+        return NULL;
+    }
+
+    blockHeader *bf = find_block(h, blockSize);
+
+    if (bf == NULL) {
+        return NULL;
+    }
+    return take_block(h, bf, blockSize);
+} 
+
+/*
+ * Like alloc_block(), but the payload is aligned to 'align', a power of
+ * two above ALIGNMENT.  The block found has room for the payload at any
+ * alignment, and the bytes in front of the aligned payload are split
+ * off as a free block of their own, so that they stay usable.
+ * The caller must hold h->lock.
+ * Returns address of allocated block (payload) on success.
+ * Returns NULL on failure.
+ */
+static void* alloc_aligned_block(heap_t *h, size_t size, size_t align) {
+
+    if (size < 1 || size > h->alloc_size || align > h->alloc_size) {
+        return NULL;
+    }
+
+    // The front block is never more than align + MIN_BLOCK_SIZE bytes.
+    size_t blockSize = block_size_for(size);
+    size_t need = blockSize + align + MIN_BLOCK_SIZE;
+
+    if (need > h->alloc_size) {
+        return NULL;
+    }
+
+    blockHeader *bf = find_block(h, need);
+
+    if (bf == NULL) {
+        return NULL;
+    }
+
+    uintptr_t payload = ((uintptr_t)(bf + 1) + align - 1) & ~(uintptr_t)(align - 1);
+    size_t gap = payload - (uintptr_t)(bf + 1);
+
+    // A gap too small for a free block moves on to the next aligned address.
+    if (gap != 0 && gap < MIN_BLOCK_SIZE) {
+        gap += align;
+    }
+
+    if (gap != 0) {
+        size_t bfs = (bf->size_status) & sMask;
+        blockHeader *rest = (blockHeader*)((char*)bf + gap);
+
+        list_remove(h, bf);
+
+        bf->size_status = gap + ((bf->size_status) & pBit);
+        (rest - 1)->size_status = gap;
+
+        // Free for now, take_block() allocates it right away.
+        rest->size_status = bfs - gap;
+        ((blockHeader*)((char*)rest + bfs - gap) - 1)->size_status = bfs - gap;
+
+        list_insert(h, bf);
+        list_insert(h, rest);
+        h->splits++;
+        bf = rest;
+    }
+    return take_block(h, bf, blockSize);
+} 
+
+/* 
+ * Function for freeing up a previously allocated block of arena 'h'.
+ * The caller must hold h->lock and ptr must be a payload in h.
+ * Argument ptr: address of the block to be freed up.
+ * Returns the free block ptr ended up in, after coalescing.
+ * Returns NULL if ptr block is already freed.
+ * Update header(s) and footer as needed.
+ *
+ * If free results in two or more adjacent free blocks,
+ * they will be immediately coalesced into one larger free block.
+ * so free blocks require a footer (blockHeader works) to store the size
+ */                    
+static blockHeader* free_block_in(heap_t *h, void *ptr) {
+
+    blockHeader *header = (blockHeader *) ( (char *) ptr - sizeof(blockHeader));
+    size_t headerSize = (header->size_status) & sMask;
+    blockWord headerStatus = (header->size_status) & aBit;
+
+    if(headerStatus == 0) {
+        return NULL;
+    }
+
+    blockHeader *next = (blockHeader *) ((char *) header + headerSize);
+    blockWord pStatus = (header->size_status) & pBit;
+
+    // Coalesce with the next block if it is free.
+    // The end mark is never free.
+    if(((next->size_status) & aBit) == 0) {
+        list_remove(h, next);
+        headerSize += (next->size_status) & sMask;
+        block_merged(h, next, header);
+        h->coalesces++;
+    }
+
+    // Coalesce with the previous block if it is free.
+    // Its footer is the blockHeader right before this header.
+    if(pStatus == 0) {
+        blockHeader *prevFooter = header - 1;
+        blockHeader *prev = (blockHeader *) ((char *) header - prevFooter->size_status);
+
+        list_remove(h, prev);
+        headerSize += prevFooter->size_status;
+        pStatus = (prev->size_status) & pBit;
+        block_merged(h, header, prev);
+        header = prev;
+        h->coalesces++;
+    }
+
+    header->size_status = headerSize + pStatus;
+
+    blockHeader *footer = (blockHeader *) ((char *) header + headerSize - sizeof(blockHeader));
+    footer->size_status = headerSize;
+
+    // The block after the coalesced block now follows a free block.
+    next = (blockHeader *) ((char *) header + headerSize);
+    (next->size_status) &= ~pBit;
+
+    list_insert(h, header);
+    h->used_blocks--;
+
+    return header;
+    
+} 
+
+/*
+ * Gives the pages inside free block 'block' back to the O.S.
+ * The header, free list links and footer stay in place, only whole pages
+ * between them are released, so the block is still a valid free block.
+ * With 'lazy' set MADV_FREE is used where available, which is cheaper but
+ * leaves the pages in the RSS until the O.S. needs them.
+ * Pages are those of the region of arena 'h', so huge pages are only
+ * released whole.  The pages of a heap file are punched out of the file
+ * with MADV_REMOVE, dropping them from the mapping would keep them on disk.
+ * The caller must hold h->lock.
+ * Returns the number of bytes released.
+ */
+static size_t trim_block(heap_t *h, blockHeader *block, int lazy) {
+
+    size_t size = (block->size_status) & sMask;
+    uintptr_t first = (uintptr_t)(links_of(block) + 1);
+    uintptr_t last = (uintptr_t)block + size - HEADER_SIZE;
+
+    first = (first + h->region_page - 1) & ~(uintptr_t)(h->region_page - 1);
+    last = last & ~(uintptr_t)(h->region_page - 1);
+
+    if (last <= first) {
+        return 0;
+    }
+
+    if (h->fd >= 0) {
+        return madvise((void*)first, last - first, MADV_REMOVE) == 0 ? last - first : 0;
+    }
+
+#ifdef MADV_FREE
+    if (lazy && madvise((void*)first, last - first, MADV_FREE) == 0) {
+        return last - first;
+    }
+#else
+    (void)lazy;
+#endif
+    if (madvise((void*)first, last - first, MADV_DONTNEED) != 0) {
+        return 0;
+    }
+    return last - first;
+}
+
+/*
+ * Shrinks the heap of arena 'h' when its last block is free, moving the
+ * end mark back so that the last block keeps at least MIN_BLOCK_SIZE bytes
+ * and the heap keeps at least h->config.initial_size bytes.
+ * The pages past the new end are released and mapped PROT_NONE again,
+ * so grow_heap() can reuse them later, and a heap file is cut to the new
+ * end.
+ * The caller must hold h->lock.
+ * Returns the number of bytes released.
+ */
+static size_t trim_tail(heap_t *h) {
+
+    blockHeader *end_mark = (blockHeader*)((char*)h->heap_start + h->alloc_size);
+
+    if (((end_mark->size_status) & pBit) != 0) {
+        return 0;
+    }
+
+    blockHeader *last = (blockHeader*)((char*)end_mark - (end_mark - 1)->size_status);
+    uintptr_t map_end = (uintptr_t)h + h->map_size;
+
+    // New end of the usable part: room for the last block and end mark.
+    uintptr_t keep = (uintptr_t)last + MIN_BLOCK_SIZE + HEADER_SIZE;
+    uintptr_t min_keep = (uintptr_t)(h->heap_start - 1) + h->config.initial_size;
+
+    keep = (keep + h->region_page - 1) & ~(uintptr_t)(h->region_page - 1);
+    min_keep = (min_keep + h->region_page - 1) & ~(uintptr_t)(h->region_page - 1);
+    if (keep < min_keep) {
+        keep = min_keep;
+    }
+    if (keep >= map_end) {
+        return 0;
+    }
+
+    // Resize the last block and move the end mark in front of 'keep'.
+    list_remove(h, last);
+
+    blockHeader *new_end = (blockHeader*)keep - 1;
+    size_t lastSize = (char*)new_end - (char*)last;
+
+    last->size_status = lastSize + ((last->size_status) & pBit);
+    (new_end - 1)->size_status = lastSize;
+    new_end->size_status = 1;
+
+    list_insert(h, last);
+
+    __atomic_store_n(&h->alloc_size, (char*)new_end - (char*)h->heap_start, __ATOMIC_RELAXED);
+
+    madvise((void*)keep, map_end - keep, MADV_DONTNEED);
+    mprotect((void*)keep, map_end - keep, PROT_NONE);
+    h->map_size = keep - (uintptr_t)h;
+    if (h->fd >= 0 && ftruncate(h->fd, h->map_size) != 0) {
+        // The file stays longer than the heap, which only wastes space.
+    }
+
+    return map_end - keep;
+}
+
+/*
+ * Applies automatic trimming after 'freed' became a free block of 'h':
+ * once it is at least h->config.trim_threshold bytes, a last block is cut
+ * back with trim_tail() and the pages inside it are released lazily.
+ * The caller must hold h->lock.
+ */
+static void auto_trim(heap_t *h, blockHeader *freed) {
+
+    size_t size = (freed->size_status) & sMask;
+
+    if (h->config.trim_threshold == 0 || size < h->config.trim_threshold) {
+        return;
+    }
+
+    blockHeader *next = (blockHeader*)((char*)freed + size);
+
+    if ((next->size_status & sMask) == 0) {
+        trim_tail(h);
+    }
+    trim_block(h, freed, 1);
+} 
+
+/* 
+ * Puts the blocks other threads freed back into arena 'h'.
+ * The caller must hold h->lock.
+ */
+static void drain_remote_frees(heap_t *h) {
+
+    // Cheap check first so the common case does no atomic write.
+    if (atomic_load_explicit(&h->remote_frees, memory_order_relaxed) == NULL) {
+        return;
+    }
+
+    void *ptr = atomic_exchange_explicit(&h->remote_frees, NULL, memory_order_acquire);
+
+    while (ptr != NULL) {
+        void *next = *(void**)ptr;
+        blockHeader *freed = free_block_in(h, ptr);
+        if (freed != NULL) {
+            auto_trim(h, freed);
+        }
+        ptr = next;
+    }
+}
+
+/* Returns 1 if ptr lies inside the payload area of arena 'h'. */
+static int heap_contains(heap_t *h, void *ptr) {
+    // The first payload is right after heap_start, and the last one
+    // must leave room for its header before the end mark.
+    // alloc_size only changes under h->lock, other threads see either value.
+    return (char*)ptr >= (char*)(h->heap_start + 1) &&
+           (char*)ptr < (char*)h->heap_start + __atomic_load_n(&h->alloc_size, __ATOMIC_RELAXED);
+}
+
+/* Returns the arena whose heap contains ptr, or NULL. */
+static heap_t* heap_of(void *ptr) {
+
+    if (thread_heap != NULL && heap_contains(thread_heap, ptr)) {
+        return thread_heap;
+    }
+
+    int count = atomic_load_explicit(&num_arenas, memory_order_acquire);
+
+    for (int i = 0; i < count; i++) {
+        if (heap_contains(arenas[i], ptr)) {
+            return arenas[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Returns the number of NUMA nodes the O.S. reports online, capped at
+ * NUMA_MAX_NODES, or 1 if it reports none.
+ * Reads the file with read(), stdio may call malloc().
+ */
+static int count_numa_nodes() {
+
+    char text[256];
+    int fd = open("/sys/devices/system/node/online", O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1) {
+        return 1;
+    }
+
+    ssize_t length = read(fd, text, sizeof(text) - 1);
+    close(fd);
+
+    // A list of ranges like "0-1,4"; the highest number is the last one.
+    int highest = 0, number = 0;
+
+    for (ssize_t i = 0; i < length; i++) {
+        if (text[i] >= '0' && text[i] <= '9') {
+            number = number * 10 + (text[i] - '0');
+            if (number > highest) {
+                highest = number;
+            }
+        } else {
+            number = 0;
+        }
+    }
+    return highest + 1 < NUMA_MAX_NODES ? highest + 1 : NUMA_MAX_NODES;
+}
+
+/* Returns the NUMA node of the CPU the calling thread runs on. */
+static int current_node() {
+
+    unsigned cpu, node;
+
+    if (numa_nodes <= 1 || syscall(SYS_getcpu, &cpu, &node, NULL) != 0 ||
+        node >= NUMA_MAX_NODES) {
+        return 0;
+    }
+    return node;
+}
+
+/*
+ * Asks the O.S. to place the pages of 'size' bytes at 'addr' on NUMA
+ * node 'node' as they are first touched, falling back to other nodes when
+ * it is full.  Only a hint: without NUMA, or if it fails, pages are placed
+ * on the node of the thread touching them first.
+ */
+static void bind_node(void *addr, size_t size, int node) {
+
+    if (numa_nodes <= 1) {
+        return;
+    }
+
+    unsigned long mask = 1UL << node;
+
+    // The O.S. takes one bit more than the mask holds, as numactl passes it.
+    syscall(SYS_mbind, addr, size, NUMA_MPOL_PREFERRED, &mask, 8 * sizeof(mask) + 1, 0);
+}
+
+/*
+ * Returns the granularity of a region backed by pages of mode 'pages',
+ * see heapPages.
+ */
+static size_t region_page_for(heapPages pages) {
+
+    switch (pages) {
+    case P3HEAP_PAGES_TRANSPARENT:
+        return THP_PAGE_SIZE;
+    case P3HEAP_PAGES_HUGE_2M:
+        return (size_t)2 << 20;
+    case P3HEAP_PAGES_HUGE_1G:
+        return (size_t)1 << 30;
+    default:
+        return page_size;
+    }
+}
+
+/*
+ * Reserves 'size' bytes of address space, starting at a multiple of
+ * 'align', with mmap() flags 'flags'.  Nothing is committed.
+ * Returns the start of the range, or MAP_FAILED.
+ */
+static void* reserve_range(size_t size, size_t align, int flags) {
+
+    if (align <= page_size) {
+        return mmap(NULL, size, PROT_NONE, flags, -1, 0);
+    }
+
+    // Over-reserve and cut off what lies outside the aligned range.
+    char *ptr = mmap(NULL, size + align, PROT_NONE, flags, -1, 0);
+
+    if (ptr == MAP_FAILED) {
+        return MAP_FAILED;
+    }
+
+    char *start = (char*)(((uintptr_t)ptr + align - 1) & ~(uintptr_t)(align - 1));
+
+    if (start != ptr) {
+        munmap(ptr, start - ptr);
+    }
+    munmap(start + size, ptr + align - start);
+    return start;
+}
+
+/*
+ * Reserves a new region and sets it up as an arena of NUMA node 'node', as
+ * configured by 'config'.  The whole region is bound to the node before
+ * any page of it is touched.  Only the heap_t and the first
+ * config->initial_size bytes of heap are usable, the region up to
+ * config->max_size is reserved so that grow_heap() can extend the heap
+ * in place.
+ * Sizes in 'config' must already be multiples of the page size.
+ *
+ * With config->pages asking for MAP_HUGETLB pages the region is rounded
+ * to whole huge pages, which the O.S. sets aside right away, so touching
+ * them later can never fail.  If it does not have enough of them the
+ * region falls back to transparent huge pages.  Those, and regions that
+ * asked for them, are normal pages marked MADV_HUGEPAGE, which the O.S.
+ * backs with huge pages when it can.
+ *
+ * With 'fd' not -1 the region is a MAP_SHARED mapping of that file, which
+ * must be open for reading and writing, instead of anonymous memory.
+ * The file is cut to the committed part of the region, see grow_heap(),
+ * and config->pages and 'node' are ignored.
+ * Returns the new arena, or NULL if the region cannot be mapped.
+ */
+static heap_t* create_arena(const heapConfig *config, int node, int fd) {
+
+    size_t hdrsize;  // pages used by the heap_t at the start of the region
+    size_t reserve;  // size of the whole reserved range
+    size_t region;   // granularity of the region, see heap_t.region_page
+    void*  mmap_ptr = MAP_FAILED; // pointer to memory mapped area
+
+    blockHeader* end_mark;
+
+    hdrsize = REGION_HEADER_SIZE(page_size);
+
+    if (fd >= 0) {
+        region = page_size;
+        reserve = hdrsize + config->max_size;
+
+        // Only the part committed below is backed by the file.
+        mmap_ptr = mmap(NULL, reserve, PROT_NONE, MAP_SHARED, fd, 0);
+        if (MAP_FAILED == mmap_ptr) {
+            fprintf(stderr, "Error:mem.c: mmap cannot map the heap file\n");
+            return NULL;
+        }
+    } else if (config->pages == P3HEAP_PAGES_HUGE_2M || config->pages == P3HEAP_PAGES_HUGE_1G) {
+        int shift = config->pages == P3HEAP_PAGES_HUGE_2M ? 21 : 30;
+
+        region = region_page_for(config->pages);
+        reserve = (hdrsize + config->max_size + region - 1) & ~(region - 1);
+        mmap_ptr = mmap(NULL, reserve, PROT_NONE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (shift << MAP_HUGE_SHIFT), -1, 0);
+    }
+
+    if (MAP_FAILED == mmap_ptr) {
+        region = config->pages != P3HEAP_PAGES_NORMAL ? THP_PAGE_SIZE : page_size;
+        reserve = (hdrsize + config->max_size + region - 1) & ~(region - 1);
+
+        // Reserve the range, nothing is committed for PROT_NONE
+        mmap_ptr = reserve_range(reserve, region, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE);
+        if (MAP_FAILED == mmap_ptr) {
+            fprintf(stderr, "Error:mem.c: mmap cannot allocate space\n");
+            return NULL;
+        }
+        if (region != page_size) {
+            madvise(mmap_ptr, reserve, MADV_HUGEPAGE);
+        }
+    }
+
+    // The first commit is rounded to the region's pages too.
+    size_t initial = ((hdrsize + config->initial_size + region - 1) & ~(region - 1)) - hdrsize;
+
+    if (fd >= 0) {
+        if (ftruncate(fd, hdrsize + initial) != 0) {
+            fprintf(stderr, "Error:mem.c: cannot extend the heap file\n");
+            munmap(mmap_ptr, reserve);
+            return NULL;
+        }
+    } else {
+        bind_node(mmap_ptr, reserve, node);
+    }
+    if (mprotect(mmap_ptr, hdrsize + initial, PROT_READ | PROT_WRITE) != 0) {
+        fprintf(stderr, "Error:mem.c: mprotect cannot commit space\n");
+        munmap(mmap_ptr, reserve);
+        return NULL;
+    }
+
+    heap_t *h = (heap_t*) mmap_ptr;
+
+    pthread_mutex_init(&h->lock, NULL);
+    h->config = *config;
+    h->fd = fd;
+    h->map_size = hdrsize + initial;
+    h->reserve_size = reserve;
+    h->region_page = region;
+    h->threads = 0;
+    h->node = node;
+    atomic_init(&h->remote_frees, NULL);
+
+    h->free_bytes = 0;
+    h->free_blocks = 0;
+    h->used_blocks = 0;
+    h->alloc_calls = 0;
+    h->free_calls = 0;
+    h->failed_allocs = 0;
+    h->splits = 0;
+    h->coalesces = 0;
+    memset(&h->profile, 0, sizeof(h->profile));
+
+    // for alignment and end mark
+    h->alloc_size = initial - 2 * HEADER_SIZE;
+
+    // Initially there is only one big free block in the heap.
+    // Skip first header word for the payload alignment requirement.
+    h->heap_start = (blockHeader*) ((char*)mmap_ptr + hdrsize) + 1;
+
+    // Set the end mark
+    end_mark = (blockHeader*)((char*)h->heap_start + h->alloc_size);
+    end_mark->size_status = 1;
+
+    // Set size in header
+    h->heap_start->size_status = h->alloc_size;
+
+    // Set p-bit as allocated in header
+    // note a-bit left at 0 for free
+    h->heap_start->size_status += 2;
+
+    // Set the footer
+    blockHeader *footer = (blockHeader*) ((char*)h->heap_start + h->alloc_size - HEADER_SIZE);
+    footer->size_status = h->alloc_size;
+
+    // The whole heap starts out on one free list.
+    memset(h->free_lists, 0, sizeof(h->free_lists));
+    memset(h->class_map, 0, sizeof(h->class_map));
+    h->class_summary = 0;
+    list_insert(h, h->heap_start);
+    h->rover = h->heap_start;
+    h->check_last = NULL;
+
+    return h;
+}
+
+/*
+ * Grows the heap of arena 'h' so that a payload of 'size' bytes fits
+ * in its last block.  The caller must hold h->lock.
+ *
+ * More of the reserved range is committed at the end of the heap, and a
+ * heap file is extended to cover it first.
+ * The old end mark becomes the header of a new block covering that space,
+ * which is freed so it coalesces with the last block if that is free.
+ * The heap grows by at least h->config.grow_size bytes, or doubles
+ * when grow_size is 0, but never past h->config.max_size.
+ * Returns 0 on success.
+ * Returns -1 if the reserved range is used up, or the heap file cannot
+ * be extended.
+ */
+static int grow_heap(heap_t *h, size_t size) {
+
+    if (size > h->reserve_size) {
+        return -1;
+    }
+
+    blockHeader *end_mark = (blockHeader*)((char*)h->heap_start + h->alloc_size);
+    size_t need = block_size_for(size);
+
+    // A free last block already covers part of the request.
+    if (((end_mark->size_status) & pBit) == 0) {
+        size_t last = (end_mark - 1)->size_status;
+        need = last < need ? need - last : 0;
+    }
+
+    size_t grow = h->config.grow_size != 0 ? h->config.grow_size : h->alloc_size;
+    if (grow < need) {
+        grow = need;
+    }
+    grow = (grow + h->region_page - 1) / h->region_page * h->region_page;
+
+    size_t room = h->reserve_size - h->map_size;
+    if (grow > room) {
+        if (need > room) {
+            return -1;
+        }
+        grow = room;
+    }
+
+    if (h->fd >= 0 && ftruncate(h->fd, h->map_size + grow) != 0) {
+        return -1;
+    }
+    if (mprotect((char*)h + h->map_size, grow, PROT_READ | PROT_WRITE) != 0) {
+        return -1;
+    }
+    h->map_size += grow;
+
+    // The new block keeps the end mark's p-bit and is marked allocated,
+    // so free_block_in() can coalesce and list it.
+    end_mark->size_status = grow + ((end_mark->size_status) & pBit) + 1;
+
+    blockHeader *new_end = (blockHeader*)((char*)end_mark + grow);
+    new_end->size_status = 1 + 2;
+
+    __atomic_store_n(&h->alloc_size, h->alloc_size + grow, __ATOMIC_RELAXED);
+
+    h->used_blocks++;
+    free_block_in(h, end_mark + 1);
+
+    return 0;
+}
+
+/*
+ * Pops a cached block that fits a payload of 'size' bytes.
+ * Returns NULL if the bin for its block size is empty.
+ */
+static void* tcache_get(size_t size) {
+
+    int bin = block_size_for(size) / ALIGNMENT;
+    void *ptr = thread_cache.bins[bin];
+
+    if (ptr != NULL) {
+        thread_cache.bins[bin] = *(void**)ptr;
+        thread_cache.counts[bin]--;
+    }
+    return ptr;
+}
+
+/*
+ * Caches allocated block 'ptr' of the calling thread's arena.
+ * Returns 1 if it was cached, 0 if it has to be freed to the heap.
+ * Returns -1 if it is the block freed last in its bin, a double free.
+ */
+static int tcache_put(void *ptr) {
+
+    blockHeader *header = (blockHeader *) ( (char *) ptr - sizeof(blockHeader));
+    size_t size = (header->size_status) & sMask;
+
+    if(size > TCACHE_MAX_BLOCK || ((header->size_status) & aBit) == 0 || heap_fd >= 0) {
+        return 0;
+    }
+
+    int bin = size / ALIGNMENT;
+
+    if(thread_cache.bins[bin] == ptr) {
+        return -1;
+    }
+    if(thread_cache.counts[bin] >= TCACHE_DEPTH) {
+        return 0;
+    }
+
+    *(void**)ptr = thread_cache.bins[bin];
+    thread_cache.bins[bin] = ptr;
+    thread_cache.counts[bin]++;
+    return 1;
+}
+
+/*
+ * Gives every block in the calling thread's cache back to its heap 'h'.
+ * The caller must hold h->lock.
+ */
+static void tcache_flush(heap_t *h) {
+
+    for (int bin = 0; bin < (int)TCACHE_BINS; bin++) {
+        void *ptr = thread_cache.bins[bin];
+
+        while (ptr != NULL) {
+            void *next = *(void**)ptr;
+            free_block_in(h, ptr);
+            ptr = next;
+        }
+        thread_cache.bins[bin] = NULL;
+        thread_cache.counts[bin] = 0;
+    }
+}
+
+/*
+ * Adds the calls the calling thread made without the lock of its arena
+ * 'h' to the counters of 'h'.  The caller must hold h->lock.
+ */
+static void count_calls(heap_t *h) {
+
+    h->alloc_calls += thread_cache.allocs;
+    h->free_calls += thread_cache.frees;
+    h->failed_allocs += thread_cache.failures;
+
+    thread_cache.allocs = 0;
+    thread_cache.frees = 0;
+    thread_cache.failures = 0;
+}
+
+/*
+ * pthread key destructor, gives the exiting thread's cached blocks back
+ * to its heap and releases its arena.
+ */
+static void thread_exit(void *arg) {
+
+    heap_t *h = (heap_t*) arg;
+
+    pthread_mutex_lock(&h->lock);
+    tcache_flush(h);
+    count_calls(h);
+    pthread_mutex_unlock(&h->lock);
+
+    pthread_mutex_lock(&arena_lock);
+    h->threads--;
+    pthread_mutex_unlock(&arena_lock);
+
+    if (thread_ring != NULL) {
+        atomic_store_explicit(&thread_ring->in_use, 0, memory_order_release);
+        thread_ring = NULL;
+    }
+}
+
+/*
+ * Returns the arena of the calling thread, binding the thread to one
+ * on its first call.  A thread gets an arena of the NUMA node it runs on
+ * that no other thread is using, creating one if needed.  Once MAX_ARENAS
+ * exist, or a new region cannot be mapped, it shares the arena of its
+ * node with the fewest threads, or of any node if its node has none.
+ * A thread that later moves to another node keeps its arena.  Blocks it
+ * frees always go back to the arena that owns them, see free_untimed().
+ * Returns NULL if init_heap() has not been called.
+ */
+static heap_t* thread_arena() {
+
+    if (thread_heap != NULL) {
+        return thread_heap;
+    }
+
+    if (atomic_load_explicit(&num_arenas, memory_order_acquire) == 0) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&arena_lock);
+
+    int node = current_node();
+    int count = atomic_load_explicit(&num_arenas, memory_order_relaxed);
+    heap_t *h = NULL;       // least used arena of the node
+    heap_t *any = arenas[0];  // least used arena of all
+
+    for (int i = 0; i < count; i++) {
+        if (arenas[i]->threads < any->threads) {
+            any = arenas[i];
+        }
+        if (arenas[i]->node == node && (h == NULL || arenas[i]->threads < h->threads)) {
+            h = arenas[i];
+        }
+    }
+
+    // A heap file holds a single arena that every thread shares.
+    if ((h == NULL || h->threads > 0) && count < MAX_ARENAS && heap_fd < 0) {
+        heap_t *created = create_arena(&heap_config, node, -1);
+
+        if (created != NULL) {
+            arenas[count] = created;
+            atomic_store_explicit(&num_arenas, count + 1, memory_order_release);
+            h = created;
+        }
+    }
+    if (h == NULL) {
+        h = any;
+    }
+
+    h->threads++;
+    thread_heap = h;
+
+    pthread_mutex_unlock(&arena_lock);
+
+    pthread_setspecific(thread_key, h);
+
+    return h;
+}
+
+/* Links mapping 'large' at the front of the list of large blocks. */
+static void large_link(largeBlock *large) {
+
+    pthread_mutex_lock(&large_lock);
+    large->prev = NULL;
+    large->next = large_blocks;
+    if (large_blocks != NULL) {
+        large_blocks->prev = large;
+    }
+    large_blocks = large;
+    large_count++;
+    large_bytes += large->map_size;
+    pthread_mutex_unlock(&large_lock);
+}
+
+/* Unlinks mapping 'large' from the list of large blocks. */
+static void large_unlink(largeBlock *large) {
+
+    pthread_mutex_lock(&large_lock);
+    if (large->prev != NULL) {
+        large->prev->next = large->next;
+    } else {
+        large_blocks = large->next;
+    }
+    if (large->next != NULL) {
+        large->next->prev = large->prev;
+    }
+    large_count--;
+    large_bytes -= large->map_size;
+    pthread_mutex_unlock(&large_lock);
+}
+
+/*
+ * Returns the large block whose payload is 'ptr', or NULL.
+ * Payloads of large blocks are always LARGE_OFFSET bytes into a page, so
+ * other pointers are ruled out before any memory is read.
+ */
+static largeBlock* large_of(void *ptr) {
+
+    if (((uintptr_t)ptr & (page_size - 1)) != LARGE_OFFSET) {
+        return NULL;
+    }
+
+    blockHeader *header = (blockHeader *) ( (char *) ptr - sizeof(blockHeader));
+
+    if (header->size_status != (mBit | aBit)) {
+        return NULL;
+    }
+    return (largeBlock*)((char*)ptr - LARGE_OFFSET);
+}
+
+/*
+ * Maps a large block with a payload of 'size' bytes.
+ * Returns address of its payload on success.
+ * Returns NULL on failure.
+ */
+static void* alloc_large(size_t size) {
+
+    if (size > SIZE_MAX - LARGE_OFFSET - page_size) {
+        return NULL;
+    }
+
+    size_t map_size = (size + LARGE_OFFSET + page_size - 1) & ~(page_size - 1);
+    void *mmap_ptr = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (MAP_FAILED == mmap_ptr) {
+        return NULL;
+    }
+
+    largeBlock *large = (largeBlock*) mmap_ptr;
+    large->map_size = map_size;
+
+    blockHeader *header = (blockHeader*)((char*)mmap_ptr + LARGE_OFFSET) - 1;
+    header->size_status = mBit | aBit;
+
+    large_link(large);
+
+    return header + 1;
+}
+
+/* Unmaps large block 'large'. */
+static void free_large(largeBlock *large) {
+
+    large_unlink(large);
+    munmap(large, large->map_size);
+}
+
+/*
+ * Resizes large block 'large' to a payload of 'newSize' bytes, letting
+ * the O.S. move the mapping if it cannot grow where it is.
+ * Returns the address of the payload, NULL if the mapping cannot grow.
+ */
+static void* realloc_large(largeBlock *large, size_t newSize) {
+
+    if (newSize > SIZE_MAX - LARGE_OFFSET - page_size) {
+        return NULL;
+    }
+
+    size_t map_size = (newSize + LARGE_OFFSET + page_size - 1) & ~(page_size - 1);
+
+    // Other blocks on the list point at this one, so it is off the list
+    // while it may move.
+    large_unlink(large);
+
+    largeBlock *moved = mremap(large, large->map_size, map_size, MREMAP_MAYMOVE);
+
+    if (moved == MAP_FAILED) {
+        large_link(large);
+        return NULL;
+    }
+
+    moved->map_size = map_size;
+    large_link(moved);
+
+    return (char*)moved + LARGE_OFFSET;
+}
+
+/*
+ * Returns 'size' rounded up to whole cache lines, or 0 if that overflows.
+ * A payload of that size aligned to P3HEAP_CACHE_LINE shares no line with
+ * another block's payload: the next block's header starts the next line.
+ */
+static size_t isolated_size(size_t size) {
+
+    if (size > SIZE_MAX - P3HEAP_CACHE_LINE) {
+        return 0;
+    }
+    return (size + P3HEAP_CACHE_LINE - 1) & ~(size_t)(P3HEAP_CACHE_LINE - 1);
+}
+
+/*
+ * Allocates 'size' bytes from arena 'h', growing its heap if there is no
+ * free block for them.  The payload is aligned to 'align' if it is not 0,
+ * see alloc_aligned_block().
+ * Returns address of allocated block (payload) on success.
+ * Returns NULL on failure.
+ */
+static void* arena_alloc(heap_t *h, size_t size, size_t align) {
+
+    void *ptr;
+
+    pthread_mutex_lock(&h->lock);
+    drain_remote_frees(h);
+
+    if (align == 0) {
+        ptr = alloc_block(h, size);
+        if (ptr == NULL && size >= 1 && grow_heap(h, size) == 0) {
+            ptr = alloc_block(h, size);
+        }
+    } else {
+        ptr = alloc_aligned_block(h, size, align);
+        if (ptr == NULL && size >= 1 && size <= h->reserve_size && align <= h->reserve_size &&
+            grow_heap(h, size + align + MIN_BLOCK_SIZE) == 0) {
+            ptr = alloc_aligned_block(h, size, align);
+        }
+    }
+
+    if (h == thread_heap) {
+        count_calls(h);
+    }
+    h->alloc_calls++;
+    if (ptr == NULL) {
+        h->failed_allocs++;
+    }
+    pthread_mutex_unlock(&h->lock);
+
+    return ptr;
+}
+
+/*
+ * Frees block 'ptr' of arena 'h' right away, see free_block_in().
+ * Returns 0 on success.
+ * Returns -1 if ptr block is already freed.
+ */
+static int arena_free(heap_t *h, void *ptr) {
+
+    pthread_mutex_lock(&h->lock);
+
+    blockHeader *freed = free_block_in(h, ptr);
+
+    if (freed != NULL) {
+        auto_trim(h, freed);
+        h->free_calls++;
+    }
+    if (h == thread_heap) {
+        count_calls(h);
+    }
+    pthread_mutex_unlock(&h->lock);
+
+    return freed != NULL ? 0 : -1;
+}
+
+/*
+ * Allocates 'size' bytes of heap memory from the calling thread's arena,
+ * see alloc_block() for the placement policy.  This is alloc() without
+ * profiling.
+ * Small requests are served from the thread cache first, and requests of
+ * at least heap_config.mmap_threshold bytes get a large block.
+ * With heap_config.isolate set every block is placed as by
+ * alloc_isolated().
+ * Returns address of allocated block (payload) on success.
+ * Returns NULL on failure.
+ */
+static void* alloc_untimed(size_t size) {
+
+    // Every block of an isolated heap has its own cache lines, cached
+    // blocks of the rounded size too.
+    size_t cached = heap_config.isolate ? isolated_size(size) : size;
+
+    if (cached >= 1 && cached <= TCACHE_MAX_SIZE) {
+        void *ptr = tcache_get(cached);
+        if (ptr != NULL) {
+            thread_cache.allocs++;
+            return ptr;
+        }
+    }
+
+    heap_t *h = thread_arena();
+
+    if (h == NULL) {
+        return NULL;
+    }
+
+    if (heap_config.mmap_threshold != 0 && size >= heap_config.mmap_threshold) {
+        void *ptr = alloc_large(size);
+
+        thread_cache.allocs++;
+        if (ptr == NULL) {
+            thread_cache.failures++;
+        }
+        return ptr;
+    }
+
+    if (heap_config.isolate) {
+        return arena_alloc(h, isolated_size(size), P3HEAP_CACHE_LINE);
+    }
+    return arena_alloc(h, size, 0);
+}
+
+/*
+ * Function for freeing up a previously allocated block.
+ * Argument ptr: address of the block to be freed up.
+ * Returns 0 on success.
+ * Returns -1 on failure.
+ * This function Will:
+ * - Return -1 if ptr is NULL.
+ * - Return -1 if ptr is not a multiple of ALIGNMENT.
+ * - Return -1 if ptr is outside of the heap space of every arena,
+ *   and not a large block.
+ * - Return -1 if ptr block is already freed.
+ *   A small block still in the thread cache is only detected as freed
+ *   if it was the last one cached for its size.
+ *
+ * Large blocks are unmapped right away.
+ * Small blocks of the calling thread's arena go to the thread cache,
+ * other blocks of that arena are freed right away.  Blocks
+ * of another arena are pushed on that arena's remote_frees stack with
+ * a single compare-and-swap, and its owner frees them on its next alloc().
+ * This is free_block() without profiling.
+ */
+static int free_untimed(void *ptr) {
+
+    if((ptr == NULL) || ((uintptr_t) ptr % ALIGNMENT != 0)) {
+        return -1;
+    }
+
+    heap_t *h = heap_of(ptr);
+
+    if(h == NULL) {
+        largeBlock *large = large_of(ptr);
+
+        if(large == NULL) {
+            return -1;
+        }
+        free_large(large);
+        thread_cache.frees++;
+        return 0;
+    }
+
+    if(h == thread_heap) {
+        int cached = tcache_put(ptr);
+        if(cached != 0) {
+            if(cached == 1) {
+                thread_cache.frees++;
+            }
+            return cached == 1 ? 0 : -1;
+        }
+        return arena_free(h, ptr);
+    }
+
+    // The owner may be changing the p-bit of this header concurrently,
+    // but the a-bit of an allocated block only changes when it is freed.
+    blockHeader *header = (blockHeader *) ( (char *) ptr - sizeof(blockHeader));
+
+    if((__atomic_load_n(&header->size_status, __ATOMIC_RELAXED) & aBit) == 0) {
+        return -1;
+    }
+
+    void *head = atomic_load_explicit(&h->remote_frees, memory_order_relaxed);
+    do {
+        *(void**)ptr = head;
+    } while(!atomic_compare_exchange_weak_explicit(&h->remote_frees, &head, ptr,
+                                                   memory_order_release,
+                                                   memory_order_relaxed));
+    thread_cache.frees++;
+    return 0;
+}
+
+/*
+ * free_untimed() of block 'ptr' that was allocated for 'size' bytes.
+ * A block of the calling thread's arena small enough for the thread cache
+ * is pushed on the bin 'size' maps to without reading its header, so the
+ * free touches no memory of the block but its first word.  The block may
+ * be larger than the bin's block size, when a split left too little for a
+ * free block, which only means the next alloc() from the bin gets more
+ * than it asked for.  Other blocks are freed by free_untimed(), which
+ * decodes the header as free_block() does: coalescing needs its p-bit,
+ * and the block size is only known from it, since a block can be larger
+ * than block_size_for(size).
+ */
+static int free_sized_untimed(void *ptr, size_t size) {
+
+    heap_t *h = thread_heap;
+    size_t cached = heap_config.isolate ? isolated_size(size) : size;
+
+    if (ptr == NULL || h == NULL || cached < 1 || cached > TCACHE_MAX_SIZE ||
+        heap_fd >= 0 || !heap_contains(h, ptr)) {
+        return free_untimed(ptr);
+    }
+
+    size_t blockSize = block_size_for(cached);
+
+    int bin = blockSize / ALIGNMENT;
+
+    if (thread_cache.bins[bin] == ptr) {
+        return -1;
+    }
+    if (thread_cache.counts[bin] >= TCACHE_DEPTH) {
+        return free_untimed(ptr);
+    }
+
+    *(void**)ptr = thread_cache.bins[bin];
+    thread_cache.bins[bin] = ptr;
+    thread_cache.counts[bin]++;
+    thread_cache.frees++;
+    return 0;
+}
+
+#ifdef P3HEAP_DEBUG
+
+/*
+ * Debug mode, built with -DP3HEAP_DEBUG.
+ *
+ * Every block gets DEBUG_EXTRA bytes more than were asked for.  The last
+ * word of its usable space is a tag holding the requested size xored
+ * with DEBUG_LIVE, and the bytes between the payload and the tag, at
+ * least P3HEAP_REDZONE of them, are filled with DEBUG_CANARY.  A new
+ * payload is filled with DEBUG_NEW, so reads of memory that was never
+ * written stand out.
+ *
+ * Freeing a block checks its tag and its canary bytes, which catches
+ * writes past the end of the payload, double frees and, for
+ * free_block_sized(), a wrong size.  The payload is then filled with
+ * DEBUG_FREED, the tag xored with DEBUG_DEAD instead, and the block goes
+ * into a FIFO quarantine rather than back into the heap, so a dangling
+ * pointer keeps pointing at the fill for a while.  When a block would
+ * make the quarantine hold more than P3HEAP_QUARANTINE blocks or
+ * P3HEAP_QUARANTINE_BYTES bytes, the oldest blocks are checked for writes
+ * after free and freed for real.  Blocks of a heap file skip the quarantine, since nothing would
+ * free a quarantined block after a restart.
+ *
+ * Built with AddressSanitizer as well, the canary bytes and quarantined
+ * blocks are poisoned, so ASan reports a bad access when it happens and
+ * not when the block is freed.
+ *
+ * A damaged block is reported on stderr and never freed, so it cannot
+ * damage the heap any further; the free returns -1.
+ * Without P3HEAP_DEBUG none of this is built and the fast paths are
+ * unchanged.
+ */
+
+#ifndef P3HEAP_REDZONE
+#define P3HEAP_REDZONE 16
+#endif
+#ifndef P3HEAP_QUARANTINE
+#define P3HEAP_QUARANTINE 1024
+#endif
+#ifndef P3HEAP_QUARANTINE_BYTES
+#define P3HEAP_QUARANTINE_BYTES ((size_t)16 << 20)
+#endif
+
+#define DEBUG_EXTRA (P3HEAP_REDZONE + sizeof(size_t))
+
+#define DEBUG_NEW    0xCD
+#define DEBUG_CANARY 0xFD
+#define DEBUG_FREED  0xDD
+
+#define DEBUG_LIVE ((size_t)0x6c6976656c697665ULL)     // "livelive"
+#define DEBUG_DEAD ((size_t)0x6465616464656164ULL)     // "deaddead"
+
+#ifdef DEBUG_ASAN
+#define debug_poison(addr, size)   ASAN_POISON_MEMORY_REGION(addr, size)
+#define debug_unpoison(addr, size) ASAN_UNPOISON_MEMORY_REGION(addr, size)
+#else
+#define debug_poison(addr, size)   ((void)(addr), (void)(size))
+#define debug_unpoison(addr, size) ((void)(addr), (void)(size))
+#endif
+
+/* A quarantined block. */
+typedef struct debugEntry {
+    void *ptr;
+    heap_t *heap;       // heap from heap_create(), NULL for the default heap
+    size_t size;        // bytes that were requested
+    size_t usable;      // usable bytes of the block
+} debugEntry;
+
+// Ring of quarantined blocks, one slot even when P3HEAP_QUARANTINE is 0.
+#define QUARANTINE_SLOTS (P3HEAP_QUARANTINE > 0 ? P3HEAP_QUARANTINE : 1)
+
+static debugEntry quarantine[QUARANTINE_SLOTS];
+static size_t quarantine_first;     // index of the oldest entry
+static size_t quarantine_count;
+static size_t quarantine_bytes;     // usable bytes of all entries
+static pthread_mutex_t quarantine_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Returns the size to allocate for a payload of 'size', or 0 if too large. */
+static size_t debug_size(size_t size) {
+    return size == 0 || size > SIZE_MAX - DEBUG_EXTRA ? 0 : size + DEBUG_EXTRA;
+}
+
+/* Returns the usable bytes of allocated block 'ptr'. */
+static size_t debug_usable(void *ptr) {
+
+    blockWord status = ((blockHeader*)ptr - 1)->size_status;
+
+    if ((status & mBit) != 0) {
+        return ((largeBlock*)((char*)ptr - LARGE_OFFSET))->map_size - LARGE_OFFSET;
+    }
+    return (status & sMask) - HEADER_SIZE;
+}
+
+/* Returns the tag of block 'ptr' with 'usable' bytes. */
+static size_t debug_tag(void *ptr, size_t usable) {
+
+    char *at = (char*)ptr + usable - sizeof(size_t);
+    size_t tag;
+
+    debug_unpoison(at, sizeof(size_t));
+    memcpy(&tag, at, sizeof(size_t));
+    debug_poison(at, sizeof(size_t));
+    return tag;
+}
+
+/* Returns 1 if the 'size' bytes at 'ptr' are all 'fill'. */
+static int debug_filled(void *ptr, size_t size, unsigned char fill) {
+
+    unsigned char *bytes = ptr;
+
+    for (size_t i = 0; i < size; i++) {
+        if (bytes[i] != fill) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Returns the size that was requested for live block 'ptr' with 'usable'
+ * bytes, as its tag records it.
+ * Returns 0 if the tag is not that of a live block.
+ */
+static size_t debug_requested(void *ptr, size_t usable) {
+
+    if (usable < DEBUG_EXTRA) {
+        return 0;
+    }
+
+    size_t size = debug_tag(ptr, usable) ^ DEBUG_LIVE;
+
+    return size <= usable - DEBUG_EXTRA ? size : 0;
+}
+
+/*
+ * Sets up the payload, canary bytes and tag of block 'ptr', newly
+ * allocated for 'size' requested bytes.
+ * Returns ptr, which may be NULL.
+ */
+static void* debug_arm(void *ptr, size_t size) {
+
+    if (ptr == NULL) {
+        return NULL;
+    }
+
+    size_t usable = debug_usable(ptr);
+    size_t tag = size ^ DEBUG_LIVE;
+
+    debug_unpoison(ptr, usable);
+    memset(ptr, DEBUG_NEW, size);
+    memset((char*)ptr + size, DEBUG_CANARY, usable - sizeof(size_t) - size);
+    memcpy((char*)ptr + usable - sizeof(size_t), &tag, sizeof(size_t));
+    debug_poison((char*)ptr + size, usable - size);
+    return ptr;
+}
+
+/*
+ * Frees quarantined block 'entry' for real, unless it was written to
+ * after it was freed.
+ */
+static void debug_evict(const debugEntry *entry) {
+
+    debug_unpoison(entry->ptr, entry->usable);
+    if (!debug_filled(entry->ptr, entry->usable - sizeof(size_t), DEBUG_FREED)) {
+        fprintf(stderr, "Error: mem.c: block %p of %zu bytes was written to after it was freed\n",
+                entry->ptr, entry->size);
+        return;
+    }
+
+    if (entry->heap != NULL) {
+        arena_free(entry->heap, entry->ptr);
+    } else {
+        free_sized_untimed(entry->ptr, debug_size(entry->size));
+    }
+}
+
+/*
+ * Puts freed block 'entry' in the quarantine, making room by evicting the
+ * oldest blocks.
+ */
+static void quarantine_put(const debugEntry *entry) {
+
+    pthread_mutex_lock(&quarantine_lock);
+
+    while (quarantine_count > 0 &&
+           (quarantine_count + 1 > P3HEAP_QUARANTINE ||
+            quarantine_bytes + entry->usable > P3HEAP_QUARANTINE_BYTES)) {
+        debugEntry oldest = quarantine[quarantine_first];
+
+        quarantine_first = (quarantine_first + 1) % QUARANTINE_SLOTS;
+        quarantine_count--;
+        quarantine_bytes -= oldest.usable;
+        debug_evict(&oldest);
+    }
+
+    if (P3HEAP_QUARANTINE == 0 || entry->usable > P3HEAP_QUARANTINE_BYTES) {
+        pthread_mutex_unlock(&quarantine_lock);
+        debug_evict(entry);
+        return;
+    }
+
+    quarantine[(quarantine_first + quarantine_count) % QUARANTINE_SLOTS] = *entry;
+    quarantine_count++;
+    quarantine_bytes += entry->usable;
+    pthread_mutex_unlock(&quarantine_lock);
+}
+
+/*
+ * Drops the blocks of heap 'h' from the quarantine without freeing them,
+ * for heap_destroy().
+ */
+static void quarantine_drop(heap_t *h) {
+
+    pthread_mutex_lock(&quarantine_lock);
+
+    size_t kept = 0;
+
+    for (size_t i = 0; i < quarantine_count; i++) {
+        debugEntry *entry = &quarantine[(quarantine_first + i) % QUARANTINE_SLOTS];
+
+        if (entry->heap == h) {
+            quarantine_bytes -= entry->usable;
+        } else {
+            quarantine[(quarantine_first + kept++) % QUARANTINE_SLOTS] = *entry;
+        }
+    }
+    quarantine_count = kept;
+    pthread_mutex_unlock(&quarantine_lock);
+}
+
+/*
+ * Checks block 'ptr' of heap 'heap' from heap_create(), or of the default
+ * heap if 'heap' is NULL, and puts it in the quarantine, see "Debug mode".
+ * 'size' is the size passed to free_block_sized(), or 0.
+ * Returns 0 on success.
+ * Returns -1 if ptr is not an allocated block, or is damaged; damage is
+ * reported on stderr.
+ */
+static int debug_release(void *ptr, size_t size, heap_t *heap) {
+
+    if (ptr == NULL || (uintptr_t)ptr % ALIGNMENT != 0) {
+        return -1;
+    }
+    if (heap != NULL ? !heap_contains(heap, ptr) : heap_of(ptr) == NULL && large_of(ptr) == NULL) {
+        return -1;
+    }
+    if ((((blockHeader*)ptr - 1)->size_status & aBit) == 0) {
+        return -1;
+    }
+
+    debugEntry entry = { ptr, heap, 0, debug_usable(ptr) };
+
+    entry.size = debug_requested(ptr, entry.usable);
+    if (entry.size == 0) {
+        if (entry.usable >= DEBUG_EXTRA &&
+            (debug_tag(ptr, entry.usable) ^ DEBUG_DEAD) <= entry.usable - DEBUG_EXTRA) {
+            fprintf(stderr, "Error: mem.c: block %p is freed twice\n", ptr);
+        } else {
+            fprintf(stderr, "Error: mem.c: block %p is not from alloc() or its tag was overwritten\n", ptr);
+        }
+        return -1;
+    }
+    if (size != 0 && size != entry.size) {
+        fprintf(stderr, "Error: mem.c: block %p of %zu bytes is freed as %zu bytes\n",
+                ptr, entry.size, size);
+        return -1;
+    }
+
+    char *canary = (char*)ptr + entry.size;
+    size_t canarySize = entry.usable - sizeof(size_t) - entry.size;
+
+    debug_unpoison(canary, canarySize);
+    if (!debug_filled(canary, canarySize, DEBUG_CANARY)) {
+        fprintf(stderr, "Error: mem.c: block %p of %zu bytes was written past its end\n",
+                ptr, entry.size);
+        return -1;
+    }
+
+    size_t tag = entry.size ^ DEBUG_DEAD;
+
+    debug_unpoison(ptr, entry.usable);
+    memset(ptr, DEBUG_FREED, entry.usable - sizeof(size_t));
+    memcpy((char*)ptr + entry.usable - sizeof(size_t), &tag, sizeof(size_t));
+    debug_poison(ptr, entry.usable);
+
+    if (heap == NULL && heap_fd >= 0) {
+        debug_evict(&entry);
+    } else {
+        quarantine_put(&entry);
+    }
+    return 0;
+}
+
+/*
+ * realloc_untraced() in debug mode: the block always moves, so pointers
+ * to the old one land in the quarantine.
+ */
+static void* debug_realloc(void *ptr, size_t newSize) {
+
+    if (ptr == NULL) {
+        return debug_arm(alloc_untimed(debug_size(newSize)), newSize);
+    }
+    if (newSize == 0) {
+        debug_release(ptr, 0, NULL);
+        return NULL;
+    }
+
+    size_t oldSize = block_usable_size(ptr);
+
+    if (oldSize == 0) {
+        return NULL;
+    }
+
+    void *moved = debug_arm(alloc_untimed(debug_size(newSize)), newSize);
+
+    if (moved != NULL) {
+        memcpy(moved, ptr, oldSize < newSize ? oldSize : newSize);
+        debug_release(ptr, 0, NULL);
+    }
+    return moved;
+}
+
+#endif
+
+/* alloc_untimed(), with a redzone and tag in debug mode. */
+static inline void* alloc_checked(size_t size) {
+#ifdef P3HEAP_DEBUG
+    return debug_arm(alloc_untimed(debug_size(size)), size);
+#else
+    return alloc_untimed(size);
+#endif
+}
+
+/* free_untimed(), through the quarantine in debug mode. */
+static inline int free_checked(void *ptr) {
+#ifdef P3HEAP_DEBUG
+    return debug_release(ptr, 0, NULL);
+#else
+    return free_untimed(ptr);
+#endif
+}
+
+/* free_sized_untimed(), through the quarantine in debug mode. */
+static inline int free_sized_checked(void *ptr, size_t size) {
+#ifdef P3HEAP_DEBUG
+    return debug_release(ptr, size, NULL);
+#else
+    return free_sized_untimed(ptr, size);
+#endif
+}
+
+/*
+ * Returns a trace ring for the calling thread, reusing one given up by
+ * an exited thread if there is one.
+ * Returns NULL if no memory can be mapped for a new ring.
+ */
+static traceRing* trace_ring_claim() {
+
+    uint32_t thread = (uint32_t)syscall(SYS_gettid);
+    traceRing *ring;
+
+    for (ring = atomic_load_explicit(&trace_rings, memory_order_acquire); ring != NULL;
+         ring = ring->next) {
+        int free_ring = 0;
+
+        if (atomic_compare_exchange_strong(&ring->in_use, &free_ring, 1)) {
+            ring->thread = thread;
+            return ring;
+        }
+    }
+
+    ring = mmap(NULL, sizeof(traceRing), PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (MAP_FAILED == ring) {
+        return NULL;
+    }
+
+    // A fresh mapping is all zeros, so head, tail and dropped are 0.
+    atomic_store_explicit(&ring->in_use, 1, memory_order_relaxed);
+    ring->thread = thread;
+
+    ring->next = atomic_load_explicit(&trace_rings, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&trace_rings, &ring->next, ring,
+                                                  memory_order_release,
+                                                  memory_order_relaxed))
+        ;
+    return ring;
+}
+
+/*
+ * Records a call in the calling thread's trace ring, see heapTraceRecord.
+ */
+static void trace_record(uint32_t op, void *ptr, void *old, size_t size) {
+
+    traceRing *ring = thread_ring;
+
+    if (ring == NULL) {
+        ring = trace_ring_claim();
+        if (ring == NULL) {
+            return;
+        }
+        thread_ring = ring;
+    }
+
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= TRACE_RING_SIZE) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    heapTraceRecord *record = &ring->records[head % TRACE_RING_SIZE];
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    record->time_ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    record->ptr = (uintptr_t)ptr;
+    record->old = (uintptr_t)old;
+    record->size = size;
+    record->thread = ring->thread;
+    record->op = op;
+
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/* Returns the time of a monotonic clock in nanoseconds. */
+static uint64_t now_ns() {
+
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Returns 1 if the calling thread's current call is one of the calls
+ * that are timed, one in 'every'.
+ */
+static int sample_call(unsigned every) {
+
+    if (++thread_cache.sample_tick < every) {
+        return 0;
+    }
+    thread_cache.sample_tick = 0;
+    return 1;
+}
+
+/*
+ * Allocates 'size' bytes of heap memory, see alloc_untimed().
+ * While profiling is on the request size is counted, and one in every
+ * few calls is timed, see heap_profile_enable().
+ * While a trace is recorded the call is added to it, see heap_trace_start().
+ * Returns address of allocated block (payload) on success.
+ * Returns NULL on failure.
+ */
+void* alloc(size_t size) {
+
+    unsigned every = __atomic_load_n(&profile_every, __ATOMIC_RELAXED);
+    int traced = __atomic_load_n(&tracing, __ATOMIC_RELAXED);
+
+    if (every == 0 && !traced) {
+        return alloc_checked(size);
+    }
+
+    int timed = every != 0 && sample_call(every);
+    uint64_t start = timed ? now_ns() : 0;
+    void *ptr = alloc_checked(size);
+    heap_t *h = thread_heap;
+
+    if (traced) {
+        trace_record(P3HEAP_TRACE_ALLOC, ptr, NULL, size);
+    }
+
+    if (every != 0 && h != NULL) {
+        if (timed) {
+            profile_add(&h->profile.alloc_ns[log2_bucket(now_ns() - start,
+                                                         P3HEAP_LATENCY_BUCKETS)]);
+        }
+
+        // Requests too large for any block go in the last class.
+        int cls = NUM_CLASSES - 1;
+        if (size <= ((size_t)1 << (WORD_BITS - 1))) {
+            cls = size_class(block_size_for(size));
+        }
+        profile_add(&h->profile.sizes[cls]);
+    }
+    return ptr;
+}
+
+/*
+ * alloc_aligned() of 'space' bytes, at least 'size', for a request of
+ * 'size' bytes: debug mode records 'size' as the block's requested size
+ * and a trace records it as the size of the alloc(), so the block is
+ * freed as the caller's size.  'align' is a power of two above ALIGNMENT.
+ * Returns address of allocated block (payload) on success.
+ * Returns NULL on failure.
+ */
+static void* alloc_aligned_space(size_t size, size_t space, size_t align) {
+
+    heap_t *h = thread_arena();
+
+    if (h == NULL) {
+        return NULL;
+    }
+
+#ifdef P3HEAP_DEBUG
+    space = debug_size(space);
+#endif
+
+    void *ptr;
+
+    if (heap_config.mmap_threshold != 0 && space >= heap_config.mmap_threshold &&
+        (LARGE_OFFSET & (align - 1)) == 0) {
+        ptr = alloc_large(space);
+
+        thread_cache.allocs++;
+        if (ptr == NULL) {
+            thread_cache.failures++;
+        }
+    } else if (heap_config.isolate) {
+        ptr = arena_alloc(h, isolated_size(space), align > P3HEAP_CACHE_LINE ? align : P3HEAP_CACHE_LINE);
+    } else {
+        ptr = arena_alloc(h, space, align);
+    }
+
+#ifdef P3HEAP_DEBUG
+    ptr = debug_arm(ptr, size);
+#endif
+
+    if (__atomic_load_n(&tracing, __ATOMIC_RELAXED)) {
+        trace_record(P3HEAP_TRACE_ALLOC, ptr, NULL, size);
+    }
+    return ptr;
+}
+
+/*
+ * Allocates 'size' bytes aligned to 'align', a power of two, from the
+ * calling thread's arena.  The result is an ordinary heap block, so
+ * free_block(), realloc_block() and block_usable_size() work on it; a
+ * block that realloc_block() moves is only aligned to ALIGNMENT though.
+ * Alignments up to ALIGNMENT are what alloc() gives anyway.  Above that
+ * the slack in front of the payload is split off as a free block, see
+ * alloc_aligned_block(), and nothing is wasted.
+ * Requests of at least heap_config.mmap_threshold bytes only get a large
+ * block when LARGE_OFFSET is aligned enough, otherwise they go in the heap.
+ * With heap_config.isolate set the block is also isolated as by
+ * alloc_isolated().
+ * While a trace is recorded the call is added to it as an alloc().
+ * Returns address of allocated block (payload) on success.
+ * Returns NULL on failure, or if 'align' is not a power of two.
+ */
+void* alloc_aligned(size_t size, size_t align) {
+
+    if (align == 0 || (align & (align - 1)) != 0) {
+        return NULL;
+    }
+    if (align <= ALIGNMENT) {
+        return alloc(size);
+    }
+    return alloc_aligned_space(size, size, align);
+}
+
+/*
+ * Allocates 'size' bytes on cache lines of their own: the payload starts on
+ * a P3HEAP_CACHE_LINE boundary and its size is rounded up to whole lines,
+ * so no other block's payload shares a line with it and threads writing to
+ * neighbouring blocks never contend for one.  This is what every alloc()
+ * does with heap_config.isolate set.
+ * Large blocks have their own mapping and are isolated anyway.
+ * Returns address of allocated block (payload) on success.
+ * Returns NULL on failure.
+ */
+void* alloc_isolated(size_t size) {
+
+    if (heap_config.isolate ||
+        (heap_config.mmap_threshold != 0 && size >= heap_config.mmap_threshold)) {
+        return alloc(size);
+    }
+
+    size_t lines = isolated_size(size);
+
+    return lines == 0 ? NULL : alloc_aligned_space(size, lines, P3HEAP_CACHE_LINE);
+}
+
+/*
+ * free_block() or free_block_sized() of 'ptr' while profiling or tracing
+ * is on, with profile_every 'every' and tracing 'traced' as loaded by the
+ * caller.  'size' is 0 for free_block().
+ */
+static int free_profiled(void *ptr, size_t size, unsigned every, int traced) {
+
+    int timed = every != 0 && sample_call(every);
+    uint64_t start = timed ? now_ns() : 0;
+    int result = size != 0 ? free_sized_checked(ptr, size) : free_checked(ptr);
+    heap_t *h = thread_heap;
+
+    if (traced && result == 0) {
+        trace_record(P3HEAP_TRACE_FREE, ptr, NULL, 0);
+    }
+
+    if (timed && h != NULL) {
+        profile_add(&h->profile.free_ns[log2_bucket(now_ns() - start,
+                                                    P3HEAP_LATENCY_BUCKETS)]);
+    }
+    return result;
+}
+
+/*
+ * Frees a previously allocated block, see free_untimed().
+ * While profiling is on one in every few calls is timed,
+ * see heap_profile_enable().
+ * While a trace is recorded successful calls are added to it.
+ * Returns 0 on success.
+ * Returns -1 on failure.
+ */
+int free_block(void *ptr) {
+
+    unsigned every = __atomic_load_n(&profile_every, __ATOMIC_RELAXED);
+    int traced = __atomic_load_n(&tracing, __ATOMIC_RELAXED);
+
+    if (every == 0 && !traced) {
+        return free_checked(ptr);
+    }
+    return free_profiled(ptr, 0, every, traced);
+}
+
+/*
+ * Frees block 'ptr' that was allocated for 'size' bytes, the size passed
+ * to alloc() or realloc_block(), or to alloc_aligned() or alloc_batch().
+ * Small blocks of the calling thread's arena go to the thread cache
+ * without their header being read, see free_sized_untimed(); any other
+ * block is freed as by free_block(), header decoding included, so only
+ * small blocks free any faster.
+ * The size is trusted: only builds with P3HEAP_DEBUG check it, against
+ * the size recorded in the block, and a wrong size can corrupt the heap.
+ * Returns 0 on success.
+ * Returns -1 on failure.
+ */
+int free_block_sized(void *ptr, size_t size) {
+
+    unsigned every = __atomic_load_n(&profile_every, __ATOMIC_RELAXED);
+    int traced = __atomic_load_n(&tracing, __ATOMIC_RELAXED);
+
+    if (every == 0 && !traced) {
+        return free_sized_checked(ptr, size);
+    }
+    return free_profiled(ptr, size, every, traced);
+}
+
+/*
+ * Carves up to 'want' blocks of 'blockSize' bytes from free block 'bf' of
+ * arena 'h' in one pass, storing their payloads in 'out' in address order.
+ * The blocks lie back to back, and what is left after them is split off
+ * as one free block, if it is large enough.
+ * The caller must hold h->lock.
+ * Returns the number of blocks carved, at least one.
+ */
+static size_t carve_span(heap_t *h, blockHeader *bf, size_t blockSize, size_t want, void **out) {
+
+    size_t bfs = (bf->size_status) & sMask;
+    size_t count = bfs / blockSize < want ? bfs / blockSize : want;
+    size_t rest = bfs - count * blockSize;
+    blockWord pStatus = (bf->size_status) & pBit;
+    blockHeader *block = bf;
+
+    list_remove(h, bf);
+
+    for (size_t i = 0; i < count; i++) {
+        size_t size = blockSize;
+
+        // A rest too small for a free block goes to the last block.
+        if (i == count - 1 && rest < MIN_BLOCK_SIZE) {
+            size += rest;
+            rest = 0;
+        }
+
+        block->size_status = size + pStatus + 1;
+        pStatus = pBit;
+        out[i] = block + 1;
+        block = (blockHeader*)((char*)block + size);
+    }
+
+    if (rest != 0) {
+        // The rest follows an allocated block.
+        block->size_status = rest + 2;
+        ((blockHeader*)((char*)block + rest) - 1)->size_status = rest;
+        list_insert(h, block);
+        h->splits++;
+    } else {
+        block->size_status |= pBit;
+    }
+
+    h->splits += count - 1;
+    h->used_blocks += count;
+
+    // Next-fit carries on after the span.
+    h->rover = ((block->size_status) & sMask) == 0 ? h->heap_start : block;
+
+    return count;
+}
+
+/*
+ * Allocates up to 'n' blocks with a payload of 'size' bytes from arena
+ * 'h' into 'out'.  The placement policy is asked for one free block that
+ * holds all of them, the heap grows for it if there is none, and only
+ * then are they taken from several free blocks.
+ * The caller must hold h->lock.
+ * Returns the number of blocks allocated.
+ */
+static size_t alloc_span(heap_t *h, size_t size, size_t n, void **out) {
+
+    size_t got = 0;
+
+    // Isolated blocks have to be aligned one by one.
+    if (heap_config.isolate) {
+        size_t lines = isolated_size(size);
+
+        for (; got < n; got++) {
+            out[got] = alloc_aligned_block(h, lines, P3HEAP_CACHE_LINE);
+            if (out[got] == NULL && lines >= 1 && lines <= h->reserve_size &&
+                grow_heap(h, lines + P3HEAP_CACHE_LINE + MIN_BLOCK_SIZE) == 0) {
+                out[got] = alloc_aligned_block(h, lines, P3HEAP_CACHE_LINE);
+            }
+            if (out[got] == NULL) {
+                break;
+            }
+        }
+        return got;
+    }
+
+    if (size > h->reserve_size) {
+        return 0;
+    }
+
+    size_t blockSize = block_size_for(size);
+
+    while (got < n) {
+        size_t want = n - got;
+        size_t need = want <= h->reserve_size / blockSize ? want * blockSize : 0;
+        blockHeader *bf = NULL;
+
+        if (need != 0) {
+            bf = find_block(h, need);
+            if (bf == NULL && grow_heap(h, need - HEADER_SIZE) == 0) {
+                bf = find_block(h, need);
+            }
+        }
+
+        // No span for the rest, take any block that fits one.
+        if (bf == NULL) {
+            bf = find_block(h, blockSize);
+            if (bf == NULL && grow_heap(h, size) == 0) {
+                bf = find_block(h, blockSize);
+            }
+        }
+        if (bf == NULL) {
+            break;
+        }
+        got += carve_span(h, bf, blockSize, want, out + got);
+    }
+    return got;
+}
+
+/*
+ * Allocates 'n' blocks with a payload of 'size' bytes each into 'out', as
+ * 'n' calls of alloc() would, but with one arena lock, one search and one
+ * pass over the headers for the whole batch where the heap has a free
+ * span for it.  Such blocks are back to back in address order.
+ * The thread cache is not used, and the batch counts as 'n' calls in
+ * heap_stats().  While a trace is recorded each block is added to it.
+ * Returns the number of blocks allocated, less than 'n' only when memory
+ * ran out; the blocks allocated are in the first entries of 'out'.
+ */
+size_t alloc_batch(size_t size, size_t n, void **out) {
+
+    heap_t *h = thread_arena();
+    size_t got = 0;
+
+    if (h == NULL || size < 1 || n == 0) {
+        return 0;
+    }
+
+#ifdef P3HEAP_DEBUG
+    // One block at a time, so that each gets its own redzone.
+    while (got < n && (out[got] = alloc(size)) != NULL) {
+        got++;
+    }
+    return got;
+#endif
+
+    if (heap_config.mmap_threshold != 0 && size >= heap_config.mmap_threshold) {
+        for (; got < n; got++) {
+            out[got] = alloc_large(size);
+            if (out[got] == NULL) {
+                break;
+            }
+        }
+        thread_cache.allocs += n;
+        thread_cache.failures += n - got;
+    } else {
+        pthread_mutex_lock(&h->lock);
+        drain_remote_frees(h);
+        got = alloc_span(h, size, n, out);
+        count_calls(h);
+        h->alloc_calls += n;
+        h->failed_allocs += n - got;
+        pthread_mutex_unlock(&h->lock);
+    }
+
+    if (__atomic_load_n(&tracing, __ATOMIC_RELAXED)) {
+        for (size_t i = 0; i < got; i++) {
+            trace_record(P3HEAP_TRACE_ALLOC, out[i], NULL, size);
+        }
+    }
+    return got;
+}
+
+/* Orders payload pointers by address, for free_batch(). */
+static int compare_ptrs(const void *a, const void *b) {
+
+    uintptr_t x = (uintptr_t)*(void* const*)a, y = (uintptr_t)*(void* const*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Frees the allocated blocks run..run+count-1 of arena 'h', which lie back
+ * to back in the heap, as one block: the first header takes the size of
+ * the whole run, so the run costs one free list update and coalesces
+ * with its neighbours once.
+ * The caller must hold h->lock.
+ */
+static void free_run(heap_t *h, blockHeader *run, size_t bytes, size_t count) {
+
+    run->size_status = bytes + ((run->size_status) & ~sMask);
+    h->used_blocks -= count - 1;
+    h->coalesces += count - 1;
+
+    // Every block of the run but the first is gone, see block_merged().
+    char *end = (char*)run + bytes;
+
+    if ((char*)h->rover > (char*)run && (char*)h->rover < end) {
+        h->rover = run;
+    }
+    if ((char*)h->check_last > (char*)run && (char*)h->check_last < end) {
+        h->check_last = run;
+    }
+
+    blockHeader *freed = free_block_in(h, run + 1);
+
+    if (freed != NULL) {
+        auto_trim(h, freed);
+    }
+}
+
+/*
+ * Frees the 'n' blocks in 'ptrs', as 'n' calls of free_block() would.
+ * The pointers are sorted by address, which reorders 'ptrs', and every
+ * run of blocks lying back to back is freed as one block, so its
+ * neighbours coalesce once per run and not once per block.  Each arena is
+ * locked once for all of its blocks, and the thread cache is not used.
+ * NULL entries are skipped.
+ * Returns 0 if every other entry was freed.
+ * Returns -1 if any was not a valid allocated block; the rest are still
+ * freed.
+ */
+int free_batch(void **ptrs, size_t n) {
+
+    int result = 0;
+    int traced = __atomic_load_n(&tracing, __ATOMIC_RELAXED);
+
+    qsort(ptrs, n, sizeof(void*), compare_ptrs);
+
+#ifdef P3HEAP_DEBUG
+    // One block at a time, each checked and quarantined.
+    for (size_t i = 0; i < n; i++) {
+        if (ptrs[i] != NULL && free_block(ptrs[i]) != 0) {
+            result = -1;
+        }
+    }
+    return result;
+#endif
+
+    heap_t *locked = NULL;
+    blockHeader *run = NULL;    // first block of the pending run
+    size_t runBytes = 0, runCount = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        void *ptr = ptrs[i];
+
+        if (ptr == NULL) {
+            continue;
+        }
+        if ((uintptr_t)ptr % ALIGNMENT != 0 || (i > 0 && ptr == ptrs[i - 1])) {
+            result = -1;
+            continue;
+        }
+
+        heap_t *h = heap_of(ptr);
+
+        if (h != locked) {
+            if (locked != NULL) {
+                if (run != NULL) {
+                    free_run(locked, run, runBytes, runCount);
+                    run = NULL;
+                }
+                if (locked == thread_heap) {
+                    count_calls(locked);
+                }
+                pthread_mutex_unlock(&locked->lock);
+            }
+            locked = h;
+            if (h != NULL) {
+                pthread_mutex_lock(&h->lock);
+            }
+        }
+
+        if (h == NULL) {
+            largeBlock *large = large_of(ptr);
+
+            if (large == NULL) {
+                result = -1;
+                continue;
+            }
+            free_large(large);
+            thread_cache.frees++;
+        } else {
+            blockHeader *header = (blockHeader*)ptr - 1;
+
+            if (((header->size_status) & aBit) == 0) {
+                result = -1;
+                continue;
+            }
+
+            // Extend the pending run if this block starts where it ends.
+            if (run != NULL && (char*)run + runBytes == (char*)header) {
+                runBytes += (header->size_status) & sMask;
+                runCount++;
+            } else {
+                if (run != NULL) {
+                    free_run(h, run, runBytes, runCount);
+                }
+                run = header;
+                runBytes = (header->size_status) & sMask;
+                runCount = 1;
+            }
+            h->free_calls++;
+        }
+
+        if (traced) {
+            trace_record(P3HEAP_TRACE_FREE, ptr, NULL, 0);
+        }
+    }
+
+    if (locked != NULL) {
+        if (run != NULL) {
+            free_run(locked, run, runBytes, runCount);
+        }
+        if (locked == thread_heap) {
+            count_calls(locked);
+        }
+        pthread_mutex_unlock(&locked->lock);
+    }
+    return result;
+}
+
+/*
+ * Returns the number of payload bytes usable in allocated block 'ptr',
+ * which can be more than were requested from alloc().  In debug mode it
+ * is exactly what was requested, the rest is redzone.
+ * Returns 0 if ptr is not an allocated block of any arena or large block.
+ */
+size_t block_usable_size(void *ptr) {
+
+    if((ptr == NULL) || ((uintptr_t) ptr % ALIGNMENT != 0)) {
+        return 0;
+    }
+
+    if(heap_of(ptr) == NULL) {
+        largeBlock *large = large_of(ptr);
+#ifdef P3HEAP_DEBUG
+        return large != NULL ? debug_requested(ptr, large->map_size - LARGE_OFFSET) : 0;
+#endif
+        return large != NULL ? large->map_size - LARGE_OFFSET : 0;
+    }
+
+    blockHeader *header = (blockHeader *) ( (char *) ptr - sizeof(blockHeader));
+    blockWord status = __atomic_load_n(&header->size_status, __ATOMIC_RELAXED);
+
+    if((status & aBit) == 0) {
+        return 0;
+    }
+#ifdef P3HEAP_DEBUG
+    return debug_requested(ptr, (status & sMask) - HEADER_SIZE);
+#endif
+    return (status & sMask) - HEADER_SIZE;
+}
+
+/*
+ * Resizes allocated block 'header' of arena 'h' in place to 'blockSize'
+ * bytes.  The caller must hold h->lock.
+ *
+ * - Shrinking splits the tail off as a new block and frees it, so it
+ *   coalesces with a free next block.  A tail below MIN_BLOCK_SIZE stays.
+ * - Growing takes what it needs from the next block if that is free and
+ *   large enough, splitting off the rest as a free block.
+ *
+ * Returns 0 on success.
+ * Returns -1 if the next block is not free or too small.
+ */
+static int resize_block(heap_t *h, blockHeader *header, size_t blockSize) {
+
+    size_t headerSize = (header->size_status) & sMask;
+    blockWord status = (header->size_status) & ~sMask;
+
+    if (blockSize <= headerSize) {
+        if (headerSize - blockSize < MIN_BLOCK_SIZE) {
+            return 0;
+        }
+
+        header->size_status = blockSize + status;
+
+        // The tail starts out allocated so free_block_in() can coalesce it.
+        blockHeader *tail = (blockHeader*)((char*)header + blockSize);
+        tail->size_status = (headerSize - blockSize) + 2 + 1;
+        h->used_blocks++;
+        h->splits++;
+        free_block_in(h, tail + 1);
+
+        return 0;
+    }
+
+    blockHeader *next = (blockHeader*)((char*)header + headerSize);
+    size_t nextSize = (next->size_status) & sMask;
+
+    if (((next->size_status) & aBit) != 0 || headerSize + nextSize < blockSize) {
+        return -1;
+    }
+
+    list_remove(h, next);
+    block_merged(h, next, header);
+    h->coalesces++;
+
+    size_t total = headerSize + nextSize;
+
+    if (total - blockSize >= MIN_BLOCK_SIZE) {
+        blockHeader *splitBlock = (blockHeader*)((char*)header + blockSize);
+        size_t remainder = total - blockSize;
+
+        // The remainder follows an allocated block.
+        splitBlock->size_status = remainder + 2;
+
+        blockHeader *footer = (blockHeader*)((char*)splitBlock + remainder - HEADER_SIZE);
+        footer->size_status = remainder;
+
+        list_insert(h, splitBlock);
+        h->splits++;
+    }
+    else {
+        blockSize = total;
+
+        blockHeader *nextHeader = (blockHeader*)((char*)header + total);
+        nextHeader->size_status |= pBit;
+    }
+
+    header->size_status = blockSize + status;
+
+    return 0;
+}
+
+/*
+ * Function for resizing a previously allocated block to 'newSize' bytes.
+ * Argument ptr: address of the block, or NULL to allocate a new one.
+ * Returns the address of the resized block, which keeps the contents up to
+ * the smaller of the old and new sizes.
+ * Returns NULL on failure, leaving ptr allocated and unchanged, or when
+ * newSize is 0, in which case ptr is freed.
+ *
+ * - Shrinking always happens in place, the tail becomes a free block.
+ * - Growing happens in place when the next block is free and big enough.
+ *   A block at the end of the heap grows the heap into the reserved range.
+ * - A large block that stays at or above heap_config.mmap_threshold is
+ *   resized with mremap(), which can move it without copying.
+ * - Otherwise a new block is allocated, the payload copied and ptr freed.
+ *
+ * In debug mode the block always moves, see debug_realloc().
+ *
+ * This is realloc_block() without trace recording, the calls it makes
+ * are not recorded or profiled on their own.
+ */
+static void* realloc_untraced(void *ptr, size_t newSize) {
+
+#ifdef P3HEAP_DEBUG
+    return debug_realloc(ptr, newSize);
+#endif
+
+    if (ptr == NULL) {
+        return alloc_untimed(newSize);
+    }
+
+    if (newSize == 0) {
+        free_untimed(ptr);
+        return NULL;
+    }
+
+    if (((uintptr_t) ptr % ALIGNMENT != 0)) {
+        return NULL;
+    }
+
+    heap_t *h = heap_of(ptr);
+
+    if (h == NULL) {
+        largeBlock *large = large_of(ptr);
+
+        if (large == NULL) {
+            return NULL;
+        }
+        if (newSize >= heap_config.mmap_threshold) {
+            return realloc_large(large, newSize);
+        }
+
+        // Shrunk below the threshold, it moves into the heap.
+        void *moved = alloc_untimed(newSize);
+
+        if (moved != NULL) {
+            memcpy(moved, ptr, newSize);
+            free_large(large);
+        }
+        return moved;
+    }
+
+    blockHeader *header = (blockHeader *) ( (char *) ptr - sizeof(blockHeader));
+
+    // Blocks of another arena are resized under that arena's lock.
+    pthread_mutex_lock(&h->lock);
+
+    if (((header->size_status) & aBit) == 0) {
+        pthread_mutex_unlock(&h->lock);
+        return NULL;
+    }
+
+    size_t headerSize = (header->size_status) & sMask;
+    int ret = -1;
+
+    // A size the arena cannot hold can still move, to a large block.
+    if (newSize <= h->reserve_size) {
+        size_t blockSize = block_size_for(heap_config.isolate ? isolated_size(newSize) : newSize);
+
+        ret = resize_block(h, header, blockSize);
+        if (ret != 0) {
+            blockHeader *next = (blockHeader*)((char*)header + headerSize);
+
+            // Skip a free last block, grow_heap() merges the new space into it.
+            if (((next->size_status) & aBit) == 0) {
+                next = (blockHeader*)((char*)next + ((next->size_status) & sMask));
+            }
+
+            if ((next->size_status & sMask) == 0 &&
+                grow_heap(h, blockSize - headerSize) == 0) {
+                ret = resize_block(h, header, blockSize);
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&h->lock);
+
+    if (ret == 0) {
+        return ptr;
+    }
+
+    void *moved = alloc_untimed(newSize);
+
+    if (moved != NULL) {
+        memcpy(moved, ptr, headerSize - HEADER_SIZE);
+        free_untimed(ptr);
+    }
+    return moved;
+}
+
+/*
+ * Resizes a previously allocated block, see realloc_untraced().
+ * While a trace is recorded the call is added to it, as an alloc or free
+ * when ptr is NULL or newSize is 0.
+ */
+void* realloc_block(void *ptr, size_t newSize) {
+
+    void *resized = realloc_untraced(ptr, newSize);
+
+    if (__atomic_load_n(&tracing, __ATOMIC_RELAXED)) {
+        if (ptr == NULL) {
+            trace_record(P3HEAP_TRACE_ALLOC, resized, NULL, newSize);
+        } else if (newSize == 0) {
+            trace_record(P3HEAP_TRACE_FREE, ptr, NULL, 0);
+        } else if (resized != NULL) {
+            trace_record(P3HEAP_TRACE_REALLOC, resized, ptr, newSize);
+        }
+    }
+    return resized;
+}
+
+/*
+ * Returns free memory of every arena to the O.S.
+ * The calling thread's cached blocks are freed first.  Then a free block
+ * at the end of a heap is cut back, see trim_tail(), and the pages inside
+ * every free block that spans at least one whole page are released.
+ * Returns the number of bytes released.
+ */
+size_t heap_trim() {
+
+    size_t released = 0;
+    int count = atomic_load_explicit(&num_arenas, memory_order_acquire);
+
+    for (int i = 0; i < count; i++) {
+        heap_t *h = arenas[i];
+
+        pthread_mutex_lock(&h->lock);
+
+        if (h == thread_heap) {
+            tcache_flush(h);
+        }
+        drain_remote_frees(h);
+        released += trim_tail(h);
+
+        // Blocks in classes below two pages cannot hold a whole page.
+        for (int cls = size_class(2 * h->region_page); cls < (int)NUM_CLASSES; cls++) {
+            blockHeader *block = offset_block(h, h->free_lists[cls]);
+
+            while (block != NULL) {
+                released += trim_block(h, block, 0);
+                block = offset_block(h, links_of(block)->next);
+            }
+        }
+
+        pthread_mutex_unlock(&h->lock);
+    }
+    return released;
+}
+
+/*
+ * Returns the size of the first free block in the highest non-empty size
+ * class of arena 'h': the largest free block when the class holds one
+ * block, and less than an eighth below it otherwise.  The class list is
+ * not walked, so the lock is held for no longer with many free blocks in
+ * the class.
+ * The caller must hold h->lock.
+ */
+static size_t largest_free(heap_t *h) {
+
+    if (h->class_summary == 0) {
+        return 0;
+    }
+
+    int word = 63 - __builtin_clzll(h->class_summary);
+    int cls = word * 64 + 63 - __builtin_clzll(h->class_map[word]);
+
+    return (offset_block(h, h->free_lists[cls])->size_status) & sMask;
+}
+
+/* Adds the counters of arena 'h' to 'stats', under h->lock. */
+static void add_arena_stats(heap_t *h, heapStats *stats) {
+
+    pthread_mutex_lock(&h->lock);
+
+    if (h == thread_heap) {
+        count_calls(h);
+    }
+
+    stats->heap_bytes += h->alloc_size;
+    stats->free_bytes += h->free_bytes;
+    stats->free_blocks += h->free_blocks;
+    stats->allocated_blocks += h->used_blocks;
+    stats->alloc_calls += h->alloc_calls;
+    stats->free_calls += h->free_calls;
+    stats->failed_allocs += h->failed_allocs;
+    stats->splits += h->splits;
+    stats->coalesces += h->coalesces;
+
+    size_t largest = largest_free(h);
+    if (largest > stats->largest_free) {
+        stats->largest_free = largest;
+    }
+
+    pthread_mutex_unlock(&h->lock);
+}
+
+/* Fills in the fields of 'stats' that follow from the others. */
+static void finish_stats(heapStats *stats) {
+
+    stats->allocated_bytes = stats->heap_bytes - stats->free_bytes;
+
+    // How much of the free memory cannot be used for one large request.
+    if (stats->free_bytes != 0) {
+        stats->fragmentation = 1.0 - (double)stats->largest_free / stats->free_bytes;
+    }
+}
+
+/*
+ * Fills 'stats' with the counters of every arena and the large blocks.
+ * Each arena's lock is held only to copy its counters and find its
+ * highest non-empty size class, so this is cheap enough to call often on
+ * a live process.
+ * Blocks in thread caches count as allocated, and calls a thread served
+ * without taking its arena's lock show up once it takes it again.
+ * Heaps from heap_create() are not included, see heap_stats_of().
+ */
+void heap_stats(heapStats *stats) {
+
+    memset(stats, 0, sizeof(*stats));
+
+    int count = atomic_load_explicit(&num_arenas, memory_order_acquire);
+
+    for (int i = 0; i < count; i++) {
+        add_arena_stats(arenas[i], stats);
+    }
+
+    pthread_mutex_lock(&large_lock);
+    stats->large_blocks = large_count;
+    stats->large_bytes = large_bytes;
+    pthread_mutex_unlock(&large_lock);
+
+    finish_stats(stats);
+}
+
+/*
+ * Fills 'stats' with the counters of heap 'h', as heap_stats() does for
+ * the default heap.  Its large_blocks and large_bytes are always 0.
+ */
+void heap_stats_of(heap_t *h, heapStats *stats) {
+
+    memset(stats, 0, sizeof(*stats));
+    add_arena_stats(h, stats);
+    finish_stats(stats);
+}
+
+/*
+ * Turns profiling on, timing one in every 'sampleEvery' calls of alloc()
+ * and free_block() per thread, or off when 'sampleEvery' is 0.
+ * While it is on every alloc() also counts its request size and the
+ * number of blocks the placement policy looked at.  While it is off the
+ * only cost is one load and branch per call.
+ * Histograms are kept across calls, see heap_profile().
+ */
+void heap_profile_enable(unsigned sampleEvery) {
+    __atomic_store_n(&profile_every, sampleEvery, __ATOMIC_RELAXED);
+}
+
+/*
+ * Fills 'profile' with the histograms of every arena, added up.
+ * The counters are read without locking, so a snapshot taken while other
+ * threads allocate can be off by the calls in progress.
+ * Heaps from heap_create() are not profiled.
+ */
+void heap_profile(heapProfile *profile) {
+
+    memset(profile, 0, sizeof(*profile));
+
+    int count = atomic_load_explicit(&num_arenas, memory_order_acquire);
+    size_t *sum = (size_t*)profile;
+
+    for (int i = 0; i < count; i++) {
+        size_t *counters = (size_t*)&arenas[i]->profile;
+
+        for (size_t j = 0; j < sizeof(*profile) / sizeof(size_t); j++) {
+            sum[j] += __atomic_load_n(&counters[j], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/*
+ * Returns the smallest block size in size class 'cls', the bucket of
+ * heapProfile.sizes with the same index, or 0 if there is no such class.
+ * A block holds a payload of up to its size less one header.
+ */
+size_t heap_class_size(int cls) {
+
+    if (cls < 0 || cls >= (int)NUM_CLASSES) {
+        return 0;
+    }
+    if (cls < (int)LINEAR_CLASSES) {
+        return (size_t)cls << ALIGN_SHIFT;
+    }
+
+    int fl = LINEAR_SHIFT + (cls - LINEAR_CLASSES) / SUB_CLASSES;
+    int sl = (cls - LINEAR_CLASSES) % SUB_CLASSES;
+
+    return ((size_t)1 << fl) + ((size_t)sl << (fl - SUB_SHIFT));
+}
+
+/*
+ * Writes out the records of 'ring' the flusher has not written yet.
+ * Returns -1 if writing to the trace file fails.
+ */
+static int trace_flush_ring(traceRing *ring) {
+
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    while (tail != head) {
+        // Up to the end of the ring, the rest on the next round.
+        size_t first = tail % TRACE_RING_SIZE;
+        size_t count = head - tail;
+
+        if (count > TRACE_RING_SIZE - first) {
+            count = TRACE_RING_SIZE - first;
+        }
+
+        const char *data = (const char*)&ring->records[first];
+        size_t size = count * sizeof(heapTraceRecord);
+
+        while (size != 0) {
+            ssize_t n = write(trace_fd, data, size);
+
+            if (n < 0) {
+                return -1;
+            }
+            data += n;
+            size -= n;
+        }
+
+        tail += count;
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    }
+    return 0;
+}
+
+/* Background thread that writes the trace rings to the trace file. */
+static void* trace_flusher(void *arg) {
+
+    struct timespec pause = { 0, TRACE_FLUSH_NS };
+    int stopping;
+
+    (void)arg;
+    do {
+        stopping = __atomic_load_n(&trace_stopping, __ATOMIC_ACQUIRE);
+
+        for (traceRing *ring = atomic_load_explicit(&trace_rings, memory_order_acquire);
+             ring != NULL; ring = ring->next) {
+            trace_flush_ring(ring);
+        }
+        if (!stopping) {
+            nanosleep(&pause, NULL);
+        }
+    } while (!stopping);
+
+    return NULL;
+}
+
+/*
+ * Starts recording every alloc(), free_block() and realloc_block() call
+ * of every thread to the file at 'path', see heapTraceHeader for its
+ * layout.  Each thread's calls go to a buffer of its own without locking,
+ * and a background thread writes them out, so recording costs a clock
+ * read and a few stores per call.
+ * Returns 0 on success.
+ * Returns -1 if a trace is already being recorded or the file or the
+ * background thread cannot be created.
+ */
+int heap_trace_start(const char *path) {
+
+    pthread_mutex_lock(&trace_lock);
+
+    if (trace_fd != -1) {
+        pthread_mutex_unlock(&trace_lock);
+        return -1;
+    }
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (fd == -1) {
+        pthread_mutex_unlock(&trace_lock);
+        return -1;
+    }
+
+    heapTraceHeader header;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, P3HEAP_TRACE_MAGIC, sizeof(header.magic));
+    header.version = P3HEAP_TRACE_VERSION;
+    header.record_size = sizeof(heapTraceRecord);
+
+    if (write(fd, &header, sizeof(header)) != (ssize_t)sizeof(header)) {
+        close(fd);
+        pthread_mutex_unlock(&trace_lock);
+        return -1;
+    }
+
+    // Records left over in the rings belong to an earlier trace.
+    for (traceRing *ring = atomic_load_explicit(&trace_rings, memory_order_acquire);
+         ring != NULL; ring = ring->next) {
+        atomic_store_explicit(&ring->tail, atomic_load(&ring->head), memory_order_release);
+        atomic_store_explicit(&ring->dropped, 0, memory_order_relaxed);
+    }
+
+    trace_fd = fd;
+    __atomic_store_n(&trace_stopping, 0, __ATOMIC_RELEASE);
+
+    if (pthread_create(&trace_thread, NULL, trace_flusher, NULL) != 0) {
+        trace_fd = -1;
+        close(fd);
+        pthread_mutex_unlock(&trace_lock);
+        return -1;
+    }
+
+    __atomic_store_n(&tracing, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&trace_lock);
+    return 0;
+}
+
+/*
+ * Stops recording, writes out the records still buffered and closes the
+ * trace file.  Calls made by other threads while it stops may be lost.
+ * Returns the number of records dropped because a thread's buffer was
+ * full, 0 if no trace is being recorded.
+ */
+size_t heap_trace_stop() {
+
+    size_t dropped = 0;
+
+    pthread_mutex_lock(&trace_lock);
+
+    if (trace_fd == -1) {
+        pthread_mutex_unlock(&trace_lock);
+        return 0;
+    }
+
+    __atomic_store_n(&tracing, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&trace_stopping, 1, __ATOMIC_RELEASE);
+    pthread_join(trace_thread, NULL);
+
+    for (traceRing *ring = atomic_load_explicit(&trace_rings, memory_order_acquire);
+         ring != NULL; ring = ring->next) {
+        dropped += atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+    }
+
+    close(trace_fd);
+    trace_fd = -1;
+
+    pthread_mutex_unlock(&trace_lock);
+    return dropped;
+}
+
+/* 
+ * Object pools.
+ *
+ * A pool hands out objects of one size without a header per object.
+ * It takes chunks of at least POOL_CHUNK_SIZE bytes from the heap with
+ * alloc() and carves them into objects as they are needed.  Freed objects
+ * are kept on a list linked through their first word and are reused first,
+ * so both pool_alloc() and pool_free() take constant time.
+ * Chunks go back to the heap only when the pool is destroyed.
+ * A pool is not locked, each pool must only be used by one thread at a
+ * time.
+ */
+#define POOL_CHUNK_SIZE ((size_t)16 << 10)
+#define POOL_MIN_OBJECTS 64
+
+/* Start of a chunk, the objects follow at POOL_CHUNK_OFFSET. */
+typedef struct poolChunk {
+    struct poolChunk *next;
+} poolChunk;
+
+#define POOL_CHUNK_OFFSET \
+    ((sizeof(poolChunk) + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1))
+
+struct objPool {
+    size_t obj_size;        // bytes per object, a multiple of ALIGNMENT
+    size_t chunk_size;      // bytes per chunk including its poolChunk
+    poolChunk *chunks;      // every chunk of the pool, newest first
+    void *free_objects;     // freed objects linked through their first word
+    char *carve;            // next object never handed out in the newest chunk
+    char *carve_end;        // end of the newest chunk
+};
+
+/*
+ * Creates a pool of objects of 'objSize' bytes, rounded up to the payload
+ * alignment.
+ * Returns the pool on success.
+ * Returns NULL on failure.
+ */
+objPool* pool_create(size_t objSize) {
+
+    if (objSize == 0 || objSize > (SIZE_MAX - POOL_CHUNK_OFFSET) / POOL_MIN_OBJECTS) {
+        return NULL;
+    }
+
+    objPool *pool = alloc(sizeof(objPool));
+
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    if (objSize < sizeof(void*)) {
+        objSize = sizeof(void*);
+    }
+    pool->obj_size = (objSize + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1);
+
+    // Large enough that the chunk header is a small part of it.
+    pool->chunk_size = POOL_CHUNK_OFFSET + POOL_MIN_OBJECTS * pool->obj_size;
+    if (pool->chunk_size < POOL_CHUNK_SIZE) {
+        pool->chunk_size = POOL_CHUNK_SIZE;
+    }
+
+    pool->chunks = NULL;
+    pool->free_objects = NULL;
+    pool->carve = NULL;
+    pool->carve_end = NULL;
+
+    return pool;
+}
+
+/*
+ * Allocates an object from 'pool'.
+ * Returns address of the object on success.
+ * Returns NULL on failure.
+ */
+void* pool_alloc(objPool *pool) {
+
+    void *obj = pool->free_objects;
+
+    if (obj != NULL) {
+        pool->free_objects = *(void**)obj;
+        return obj;
+    }
+
+    if ((size_t)(pool->carve_end - pool->carve) < pool->obj_size) {
+        poolChunk *chunk = alloc(pool->chunk_size);
+
+        if (chunk == NULL) {
+            return NULL;
+        }
+
+        chunk->next = pool->chunks;
+        pool->chunks = chunk;
+        pool->carve = (char*)chunk + POOL_CHUNK_OFFSET;
+        pool->carve_end = (char*)chunk + pool->chunk_size;
+    }
+
+    obj = pool->carve;
+    pool->carve += pool->obj_size;
+    return obj;
+}
+
+/*
+ * Returns object 'ptr' to 'pool', it must have come from pool_alloc() on
+ * the same pool.  A NULL ptr is ignored.
+ */
+void pool_free(objPool *pool, void *ptr) {
+
+    if (ptr == NULL) {
+        return;
+    }
+
+    *(void**)ptr = pool->free_objects;
+    pool->free_objects = ptr;
+}
+
+/*
+ * Frees every chunk of 'pool' and the pool itself.
+ * Objects still allocated from the pool become invalid.
+ */
+void pool_destroy(objPool *pool) {
+
+    if (pool == NULL) {
+        return;
+    }
+
+    poolChunk *chunk = pool->chunks;
+
+    while (chunk != NULL) {
+        poolChunk *next = chunk->next;
+        free_block(chunk);
+        chunk = next;
+    }
+    free_block(pool);
+}
+
+/* 
+ * Regions.
+ *
+ * A region hands out memory by bumping a pointer through chunks taken
+ * from the heap with alloc(), and frees all of it at once.
+ * The first chunk is allocated together with the region.  When a request
+ * does not fit in the current chunk the region moves on to the next one,
+ * allocating one of at least the size of the first chunk if there is none
+ * or it is too small.  region_reset() keeps every chunk for reuse, so it
+ * takes constant time and a region used over and over stops allocating.
+ * A region is not locked, each region must only be used by one thread at
+ * a time.
+ */
+typedef struct regionChunk {
+    struct regionChunk *next;
+    char *end;              // end of the chunk
+} regionChunk;
+
+#define REGION_CHUNK_OFFSET \
+    ((sizeof(regionChunk) + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1))
+
+struct memRegion {
+    regionChunk *current;   // chunk being bumped through
+    char *top;              // next free byte in the current chunk
+    size_t chunk_size;      // payload bytes of the first chunk
+    regionChunk first;      // first chunk, its payload follows the region
+};
+
+#define REGION_OFFSET \
+    ((sizeof(memRegion) + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1))
+
+/*
+ * Creates a region whose first chunk holds 'bytes' bytes.
+ * Returns the region on success.
+ * Returns NULL on failure.
+ */
+memRegion* region_create(size_t bytes) {
+
+    if (bytes > SIZE_MAX - REGION_OFFSET - ALIGNMENT) {
+        return NULL;
+    }
+
+    bytes = (bytes + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1);
+    if (bytes == 0) {
+        bytes = ALIGNMENT;
+    }
+
+    memRegion *region = alloc(REGION_OFFSET + bytes);
+
+    if (region == NULL) {
+        return NULL;
+    }
+
+    region->first.next = NULL;
+    region->first.end = (char*)region + REGION_OFFSET + bytes;
+    region->chunk_size = bytes;
+    region->current = &region->first;
+    region->top = (char*)region + REGION_OFFSET;
+
+    return region;
+}
+
+/*
+ * Allocates 'size' bytes from 'region', aligned like blocks of the heap.
+ * Returns address of the memory on success.
+ * Returns NULL on failure.
+ */
+void* region_alloc(memRegion *region, size_t size) {
+
+    if (size > SIZE_MAX - REGION_CHUNK_OFFSET - ALIGNMENT) {
+        return NULL;
+    }
+
+    size = (size + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1);
+
+    if ((size_t)(region->current->end - region->top) < size) {
+        regionChunk *chunk = region->current->next;
+
+        if (chunk == NULL ||
+            (size_t)(chunk->end - (char*)chunk) < REGION_CHUNK_OFFSET + size) {
+            size_t payload = size > region->chunk_size ? size : region->chunk_size;
+
+            chunk = alloc(REGION_CHUNK_OFFSET + payload);
+            if (chunk == NULL) {
+                return NULL;
+            }
+
+            // Chunks after the current one are still kept for later.
+            chunk->next = region->current->next;
+            chunk->end = (char*)chunk + REGION_CHUNK_OFFSET + payload;
+            region->current->next = chunk;
+        }
+
+        region->current = chunk;
+        region->top = (char*)chunk + REGION_CHUNK_OFFSET;
+    }
+
+    void *ptr = region->top;
+    region->top += size;
+    return ptr;
+}
+
+/*
+ * Frees everything allocated from 'region' at once.
+ * Its chunks are kept and reused by later allocations.
+ */
+void region_reset(memRegion *region) {
+
+    region->current = &region->first;
+    region->top = (char*)region + REGION_OFFSET;
+}
+
+/*
+ * Frees every chunk of 'region' and the region itself.
+ */
+void region_destroy(memRegion *region) {
+
+    if (region == NULL) {
+        return;
+    }
+
+    regionChunk *chunk = region->first.next;
+
+    while (chunk != NULL) {
+        regionChunk *next = chunk->next;
+        free_block(chunk);
+        chunk = next;
+    }
+    free_block(region);
+}
+
+/* Set once arenas[0] exists, the allocator is only initialized once. */
+static int allocated_once = 0;
+
+/* Sets page_size, called once through pthread_once(). */
+static void read_page_size() {
+    page_size = getpagesize();
+}
+
+/* 
+ * Checks 'config' and copies it to 'out' with its sizes rounded up to
+ * the page size.
+ * Returns 0 on success.
+ * Returns -1 on failure.
+ */                    
+static int check_config(const heapConfig *config, heapConfig *out) {
+
+    static pthread_once_t page_once = PTHREAD_ONCE_INIT;
+
+    size_t padsize;  // size of padding when heap size not a multiple of page size
+
+    if (config->initial_size == 0) {
+        fprintf(stderr, "Error: mem.c: Requested block size is not positive\n");
+        return -1;
+    }
+
+    if (config->placement > P3HEAP_BEST_FIT) {
+        fprintf(stderr, "Error: mem.c: Unknown placement policy\n");
+        return -1;
+    }
+
+    if (config->pages > P3HEAP_PAGES_HUGE_1G) {
+        fprintf(stderr, "Error: mem.c: Unknown page mode\n");
+        return -1;
+    }
+
+    // Get the pagesize from O.S. 
+    pthread_once(&page_once, read_page_size);
+
+    heapConfig checked = *config;
+    if (checked.max_size < checked.initial_size) {
+        checked.max_size = checked.initial_size;
+    }
+
+    // Every block size has to fit in a header word, even rounded to
+    // the region's pages.
+    if (checked.max_size > (size_t)(blockWord)~(blockWord)0 - 2 * region_page_for(config->pages)) {
+        fprintf(stderr, "Error: mem.c: Requested heap is too large for "
+                "4-byte block headers, build with -DP3HEAP_64BIT\n");
+        return -1;
+    }
+
+    // Calculate padsize as the padding required to round up the sizes
+    // to a multiple of pagesize
+    padsize = checked.initial_size % page_size;
+    checked.initial_size += (page_size - padsize) % page_size;
+
+    padsize = checked.max_size % page_size;
+    checked.max_size += (page_size - padsize) % page_size;
+
+    *out = checked;
+    return 0;
+}
+
+/*
+ * Checks 'config' and makes it the configuration of every arena, see
+ * check_config().
+ * Returns 0 on success.
+ * Returns -1 on failure.
+ */
+static int set_config(const heapConfig *config) {
+
+    if (0 != allocated_once) {
+        fprintf(stderr, 
+                "Error: mem.c: InitHeap has allocated space during a previous call\n");
+        return -1;
+    }
+
+    if (check_config(config, &heap_config) != 0) {
+        return -1;
+    }
+
+    numa_nodes = count_numa_nodes();
+
+    return 0;
+}
+
+/* Makes 'h' the first arena and binds the calling thread to it. */
+static void start_heap(heap_t *h) {
+
+    allocated_once = 1;
+
+    pthread_key_create(&thread_key, thread_exit);
+
+    arenas[0] = h;
+    h->threads = 1;
+    thread_heap = h;
+    atomic_store_explicit(&num_arenas, 1, memory_order_release);
+
+    pthread_setspecific(thread_key, h);
+}
+
+/* 
+ * Initializes the memory allocator.
+ * Called once by a program.
+ * Argument config: sizes of the heap, see heapConfig.
+ *   The heap starts with initial_size bytes and grows on demand up to
+ *   max_size bytes.  Sizes are rounded up to the page size.
+ * Each arena created later for another thread uses the same configuration.
+ * The calling thread is bound to the first arena.
+ * Returns 0 on success.
+ * Returns -1 on failure.
+ */                    
+int init_heap_ex(const heapConfig *config) {
+
+    if (set_config(config) != 0) {
+        return -1;
+    }
+
+    heap_t *h = create_arena(&heap_config, current_node(), -1);
+    if (h == NULL) {
+        return -1;
+    }
+
+    start_heap(h);
+
+    return 0;
+} 
+
+/* 
+ * Initializes the memory allocator with a heap of 'sizeOfRegion' bytes
+ * that can grow up to P3HEAP_DEFAULT_MAX bytes (or sizeOfRegion if larger),
+ * doubling each time it grows, trims free blocks of at least
+ * P3HEAP_DEFAULT_TRIM bytes, and maps requests of at least
+ * P3HEAP_DEFAULT_MMAP bytes on their own.
+ * Returns 0 on success.
+ * Returns -1 on failure.
+ */                    
+int init_heap(size_t sizeOfRegion) {    
+
+    heapConfig config;
+
+    config.initial_size = sizeOfRegion;
+    config.max_size = P3HEAP_DEFAULT_MAX;
+    config.grow_size = 0;
+    config.trim_threshold = P3HEAP_DEFAULT_TRIM;
+    config.mmap_threshold = P3HEAP_DEFAULT_MMAP;
+    config.placement = P3HEAP_GOOD_FIT;
+    config.isolate = 0;
+    config.pages = P3HEAP_PAGES_NORMAL;
+
+    // 4-byte block headers cannot describe the default maximum.
+    if (config.max_size > (size_t)(blockWord)~(blockWord)0 / 2) {
+        config.max_size = (size_t)(blockWord)~(blockWord)0 / 2;
+    }
+
+    return init_heap_ex(&config);
+} 
+
+/*
+ * Heap handles.
+ *
+ * heap_create() sets up a heap apart from the default one that alloc()
+ * and free_block() use, for memory that should stay together or be
+ * released all at once.  It is an arena like the default heap's, in a
+ * region of its own, that no thread is bound to: any thread can use it,
+ * one at a time under its lock.  Its blocks are never cached per thread
+ * nor mapped on their own, so heap_destroy() releases all of them by
+ * unmapping the region.  alloc() and free_block() go through the same
+ * arena_alloc() and arena_free() for the arena of the calling thread.
+ */
+
+/*
+ * Creates a heap configured by 'config', see heapConfig, except that
+ * mmap_threshold is ignored: every block is placed in the heap.
+ * init_heap() does not have to be called first.
+ * Returns the heap, or NULL on failure.
+ */
+heap_t* heap_create(const heapConfig *config) {
+
+    heapConfig checked;
+
+    if (check_config(config, &checked) != 0) {
+        return NULL;
+    }
+    checked.mmap_threshold = 0;
+
+    return create_arena(&checked, current_node(), -1);
+}
+
+/*
+ * Allocates 'size' bytes from heap 'h', placed as alloc() places them in
+ * the default heap.
+ * Returns address of allocated block (payload) on success.
+ * Returns NULL on failure.
+ */
+void* heap_alloc(heap_t *h, size_t size) {
+
+#ifdef P3HEAP_DEBUG
+    size_t requested = size;
+
+    size = debug_size(size);
+#endif
+
+    void *ptr;
+
+    if (h->config.isolate) {
+        ptr = arena_alloc(h, isolated_size(size), P3HEAP_CACHE_LINE);
+    } else {
+        ptr = arena_alloc(h, size, 0);
+    }
+
+#ifdef P3HEAP_DEBUG
+    ptr = debug_arm(ptr, requested);
+#endif
+    return ptr;
+}
+
+/*
+ * Allocates 'size' bytes from heap 'h' with the payload aligned to
+ * 'align', a power of two, as alloc_aligned() places them in the default
+ * heap.
+ * Returns address of allocated block (payload) on success.
+ * Returns NULL on failure, or if 'align' is not a power of two.
+ */
+void* heap_alloc_aligned(heap_t *h, size_t size, size_t align) {
+
+    if (align == 0 || (align & (align - 1)) != 0) {
+        return NULL;
+    }
+    if (align <= ALIGNMENT) {
+        return heap_alloc(h, size);
+    }
+
+#ifdef P3HEAP_DEBUG
+    size_t requested = size;
+
+    size = debug_size(size);
+#endif
+
+    void *ptr;
+
+    if (h->config.isolate) {
+        ptr = arena_alloc(h, isolated_size(size), align > P3HEAP_CACHE_LINE ? align : P3HEAP_CACHE_LINE);
+    } else {
+        ptr = arena_alloc(h, size, align);
+    }
+
+#ifdef P3HEAP_DEBUG
+    ptr = debug_arm(ptr, requested);
+#endif
+    return ptr;
+}
+
+/*
+ * Frees block 'ptr' of heap 'h'.
+ * Returns 0 on success.
+ * Returns -1 if ptr is NULL, not a multiple of ALIGNMENT, outside the
+ * heap, or already freed.
+ */
+int heap_free(heap_t *h, void *ptr) {
+
+    if (ptr == NULL || (uintptr_t)ptr % ALIGNMENT != 0 || !heap_contains(h, ptr)) {
+        return -1;
+    }
+#ifdef P3HEAP_DEBUG
+    return debug_release(ptr, 0, h);
+#endif
+    return arena_free(h, ptr);
+}
+
+/*
+ * Releases heap 'h' from heap_create() with every block in it, in a
+ * single munmap() however many blocks it holds.  'h' and its blocks must
+ * not be used any more.
+ */
+void heap_destroy(heap_t *h) {
+
+    if (h == NULL) {
+        return;
+    }
+
+#ifdef P3HEAP_DEBUG
+    // Shadow memory outlives the mapping, so nothing may stay poisoned.
+    quarantine_drop(h);
+    debug_unpoison(h, h->map_size);
+#endif
+
+    pthread_mutex_destroy(&h->lock);
+    munmap(h, h->reserve_size);
+} 
+
+/* 
+ * 
+ * Prints out a list of all the blocks including this information:
+ * No.      : serial number of the block 
+ * Status   : free/used (allocated)
+ * Prev     : status of previous block free/used (allocated)
+ * t_Begin  : address of the first byte in the block (where the header starts) 
+ * t_End    : address of the last byte in the block 
+ * t_Size   : size of the block as stored in the block header
+ * for arena 'h'.  The caller must hold h->lock.
+ */                     
+static void disp_arena(heap_t *h) {     
+
+    int    counter;
+    char   status[6];
+    char   p_status[6];
+    char * t_begin = NULL;
+    char * t_end   = NULL;
+    size_t t_size;
+
+    blockHeader *current = h->heap_start;
+    counter = 1;
+
+    size_t used_size =  0;
+    size_t free_size =  0;
+    int    is_used   = -1;
+
+    fprintf(stdout, 
+            "********************************** HEAP: Block List ****************************\n");
+    fprintf(stdout, "No.\tStatus\tPrev\tt_Begin\t\tt_End\t\tt_Size\n");
+    fprintf(stdout, 
+            "--------------------------------------------------------------------------------\n");
+
+    while ((current->size_status & sMask) != 0) {
+        t_begin = (char*)current;
+        t_size = current->size_status;
+
+        if (t_size & 1) {
+            // LSB = 1 => used block
+            strcpy(status, "alloc");
+            is_used = 1;
+            t_size = t_size - 1;
+        } else {
+            strcpy(status, "FREE ");
+            is_used = 0;
+        }
+
+        if (t_size & 2) {
+            strcpy(p_status, "alloc");
+            t_size = t_size - 2;
+        } else {
+            strcpy(p_status, "FREE ");
+        }
+
+        if (is_used) 
+            used_size += t_size;
+        else 
+            free_size += t_size;
+
+        t_end = t_begin + t_size - 1;
+
+        fprintf(stdout, "%d\t%s\t%s\t0x%08lx\t0x%08lx\t%4zu\n", counter, status,
+                p_status, (unsigned long int)t_begin, (unsigned long int)t_end, t_size);
+
+        current = (blockHeader*)((char*)current + t_size);
+        counter = counter + 1;
+    }
+
+    fprintf(stdout, 
+            "--------------------------------------------------------------------------------\n");
+    fprintf(stdout, 
+            "********************************************************************************\n");
+    fprintf(stdout, "Total used size = %4zu\n", used_size);
+    fprintf(stdout, "Total free size = %4zu\n", free_size);
+    fprintf(stdout, "Total size      = %4zu\n", used_size + free_size);
+    fprintf(stdout, 
+            "********************************************************************************\n");
+    fflush(stdout);
+
+    return;  
+}            
+                                       
+/*
+ * Prints a list of all the large blocks including this information:
+ * No.      : serial number of the block
+ * t_Begin  : address of the first byte of its mapping
+ * t_End    : address of the last byte of its mapping
+ * t_Size   : size of the mapping
+ */
+static void disp_large() {
+
+    int    counter = 1;
+    size_t used_size = 0;
+
+    pthread_mutex_lock(&large_lock);
+
+    if (large_blocks == NULL) {
+        pthread_mutex_unlock(&large_lock);
+        return;
+    }
+
+    fprintf(stdout,
+            "********************************** HEAP: Large Blocks **************************\n");
+    fprintf(stdout, "No.\tt_Begin\t\tt_End\t\tt_Size\n");
+    fprintf(stdout,
+            "--------------------------------------------------------------------------------\n");
+
+    for (largeBlock *large = large_blocks; large != NULL; large = large->next) {
+        char *t_begin = (char*)large;
+        char *t_end = t_begin + large->map_size - 1;
+
+        fprintf(stdout, "%d\t0x%08lx\t0x%08lx\t%4zu\n", counter,
+                (unsigned long int)t_begin, (unsigned long int)t_end, large->map_size);
+
+        used_size += large->map_size;
+        counter = counter + 1;
+    }
+
+    pthread_mutex_unlock(&large_lock);
+
+    fprintf(stdout,
+            "--------------------------------------------------------------------------------\n");
+    fprintf(stdout, "Total large size = %4zu\n", used_size);
+    fprintf(stdout,
+            "********************************************************************************\n");
+    fflush(stdout);
+}
+
+/*
+ * Prints the block list of every arena, see disp_arena(),
+ * followed by the large blocks, see disp_large().
+ */
+void disp_heap() {
+
+    int count = atomic_load_explicit(&num_arenas, memory_order_acquire);
+
+    for (int i = 0; i < count; i++) {
+        pthread_mutex_lock(&arenas[i]->lock);
+        if (count > 1) {
+            fprintf(stdout, "Arena %d\n", i);
+        }
+        disp_arena(arenas[i]);
+        pthread_mutex_unlock(&arenas[i]->lock);
+    }
+
+    disp_large();
+}
+
+/*
+ * Heap dumps.
+ *
+ * The block map of an arena is first copied into a snapshot of
+ * heapDumpBlock records under the arena lock, which is only held for
+ * that walk over memory.  Formatting and writing happen afterwards with
+ * no lock held, so a slow fd or callback never stalls other threads.
+ * Output goes through a dumpStream buffer, one writer call per
+ * DUMP_BUFFER_SIZE bytes.
+ */
+#define DUMP_BUFFER_SIZE 8192
+
+typedef struct dumpStream {
+    heapDumpWriter writer;
+    void *arg;
+    int failed;             // set once a writer call has failed
+    size_t used;            // bytes in buffer
+    char buffer[DUMP_BUFFER_SIZE];
+} dumpStream;
+
+typedef struct dumpSnapshot {
+    heapDumpArena arena;
+    heapDumpBlock *blocks;  // arena.blocks records
+    size_t map_size;        // bytes mapped for blocks
+} dumpSnapshot;
+
+/* Passes the buffered output of 's' on to its writer. */
+static void dump_flush(dumpStream *s) {
+
+    if (!s->failed && s->used != 0 && s->writer(s->arg, s->buffer, s->used) != 0) {
+        s->failed = 1;
+    }
+    s->used = 0;
+}
+
+/* Appends 'size' bytes at 'data' to stream 's'. */
+static void dump_write(dumpStream *s, const void *data, size_t size) {
+
+    while (size != 0) {
+        size_t room = DUMP_BUFFER_SIZE - s->used;
+        size_t n = size < room ? size : room;
+
+        memcpy(s->buffer + s->used, data, n);
+        s->used += n;
+        data = (const char*)data + n;
+        size -= n;
+
+        if (s->used == DUMP_BUFFER_SIZE) {
+            dump_flush(s);
+        }
+    }
+}
+
+/* Appends formatted text of at most 255 bytes to stream 's'. */
+static void dump_printf(dumpStream *s, const char *format, ...) {
+
+    char text[256];
+    va_list args;
+
+    va_start(args, format);
+    int n = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+
+    if (n > 0) {
+        dump_write(s, text, (size_t)n < sizeof(text) ? (size_t)n : sizeof(text) - 1);
+    }
+}
+
+/*
+ * Copies the block map of arena 'h' into 'snap'.
+ * Returns 0 on success.
+ * Returns -1 if no memory can be mapped for the snapshot.
+ */
+static int snapshot_arena(heap_t *h, int index, dumpSnapshot *snap) {
+
+    memset(snap, 0, sizeof(*snap));
+    snap->arena.index = index;
+
+    pthread_mutex_lock(&h->lock);
+
+    size_t count = h->used_blocks + h->free_blocks;
+
+    snap->map_size = (count * sizeof(heapDumpBlock) + page_size - 1) & ~(page_size - 1);
+    if (snap->map_size != 0) {
+        snap->blocks = mmap(NULL, snap->map_size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (MAP_FAILED == snap->blocks) {
+            pthread_mutex_unlock(&h->lock);
+            snap->blocks = NULL;
+            return -1;
+        }
+    }
+
+    blockHeader *block = h->heap_start;
+    size_t n = 0;
+
+    while (((block->size_status) & sMask) != 0 && n < count) {
+        size_t size = (block->size_status) & sMask;
+
+        snap->blocks[n].offset = (char*)block - (char*)h->heap_start;
+        snap->blocks[n].size_status = block->size_status;
+        n++;
+
+        if (((block->size_status) & aBit) == 0 && size > snap->arena.largest_free) {
+            snap->arena.largest_free = size;
+        }
+        block = (blockHeader*)((char*)block + size);
+    }
+
+    snap->arena.blocks = n;
+    snap->arena.heap_bytes = h->alloc_size;
+    snap->arena.free_bytes = h->free_bytes;
+    snap->arena.free_blocks = h->free_blocks;
+
+    pthread_mutex_unlock(&h->lock);
+    return 0;
+}
+
+/*
+ * Copies the large blocks into 'snap', offsets are 0.
+ * Returns 0 on success.
+ * Returns -1 if no memory can be mapped for the snapshot.
+ */
+static int snapshot_large(dumpSnapshot *snap) {
+
+    memset(snap, 0, sizeof(*snap));
+
+    pthread_mutex_lock(&large_lock);
+
+    snap->map_size = (large_count * sizeof(heapDumpBlock) + page_size - 1) & ~(page_size - 1);
+    if (snap->map_size != 0) {
+        snap->blocks = mmap(NULL, snap->map_size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (MAP_FAILED == snap->blocks) {
+            pthread_mutex_unlock(&large_lock);
+            snap->blocks = NULL;
+            return -1;
+        }
+    }
+
+    size_t n = 0;
+
+    for (largeBlock *large = large_blocks; large != NULL; large = large->next) {
+        snap->blocks[n].offset = 0;
+        snap->blocks[n].size_status = large->map_size | mBit | aBit;
+        n++;
+    }
+    snap->arena.blocks = n;
+    snap->arena.heap_bytes = large_bytes;
+
+    pthread_mutex_unlock(&large_lock);
+    return 0;
+}
+
+/* Writes the blocks of 'snap' to 's' as JSON arrays. */
+static void dump_json_blocks(dumpStream *s, const dumpSnapshot *snap) {
+
+    for (size_t i = 0; i < snap->arena.blocks; i++) {
+        uint64_t word = snap->blocks[i].size_status;
+
+        dump_printf(s, "%s[%llu,%llu,%d,%d]", i == 0 ? "" : ",",
+                    (unsigned long long)snap->blocks[i].offset,
+                    (unsigned long long)(word & ~(uint64_t)7),
+                    (int)(word & 1), (int)((word >> 1) & 1));
+    }
+}
+
+/*
+ * Streams a dump of every arena and the large blocks to 'writer', which is
+ * called with 'arg' and consecutive pieces of the output, see heapDumpWriter.
+ * 'format' is P3HEAP_DUMP_JSON or P3HEAP_DUMP_BINARY, see p3Heap.h for
+ * both layouts.  Heaps from heap_create() are not dumped.
+ * Returns 0 on success.
+ * Returns -1 if a snapshot cannot be taken or the writer fails.
+ */
+int heap_dump_to(heapDumpWriter writer, void *arg, int format) {
+
+    if (format != P3HEAP_DUMP_JSON && format != P3HEAP_DUMP_BINARY) {
+        return -1;
+    }
+
+    // Too large for the stack of every thread.
+    dumpStream *s = mmap(NULL, sizeof(dumpStream), PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (MAP_FAILED == s) {
+        return -1;
+    }
+    s->writer = writer;
+    s->arg = arg;
+    s->failed = 0;
+    s->used = 0;
+
+    int count = atomic_load_explicit(&num_arenas, memory_order_acquire);
+    dumpSnapshot snap;
+
+    if (format == P3HEAP_DUMP_BINARY) {
+        heapDumpHeader header;
+
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, P3HEAP_DUMP_MAGIC, sizeof(header.magic));
+        header.version = P3HEAP_DUMP_VERSION;
+        header.arenas = count;
+        dump_write(s, &header, sizeof(header));
+    } else {
+        dump_printf(s, "{\"arenas\":[");
+    }
+
+    for (int i = 0; i <= count && !s->failed; i++) {
+        int large = i == count;
+
+        if ((large ? snapshot_large(&snap) : snapshot_arena(arenas[i], i, &snap)) != 0) {
+            s->failed = 1;
+            break;
+        }
+
+        if (format == P3HEAP_DUMP_BINARY) {
+            if (large) {
+                snap.arena.index = UINT32_MAX;
+            }
+            dump_write(s, &snap.arena, sizeof(snap.arena));
+            dump_write(s, snap.blocks, snap.arena.blocks * sizeof(heapDumpBlock));
+        } else if (large) {
+            dump_printf(s, "],\"large\":{\"bytes\":%llu,\"blocks\":[",
+                        (unsigned long long)snap.arena.heap_bytes);
+            dump_json_blocks(s, &snap);
+            dump_printf(s, "]}}\n");
+        } else {
+            dump_printf(s, "%s{\"index\":%d,\"heap_bytes\":%llu,\"free_bytes\":%llu,"
+                        "\"free_blocks\":%llu,\"largest_free\":%llu,\"blocks\":[",
+                        i == 0 ? "" : ",", i,
+                        (unsigned long long)snap.arena.heap_bytes,
+                        (unsigned long long)snap.arena.free_bytes,
+                        (unsigned long long)snap.arena.free_blocks,
+                        (unsigned long long)snap.arena.largest_free);
+            dump_json_blocks(s, &snap);
+            dump_printf(s, "]}");
+        }
+
+        if (snap.blocks != NULL) {
+            munmap(snap.blocks, snap.map_size);
+        }
+    }
+
+    dump_flush(s);
+
+    int result = s->failed ? -1 : 0;
+
+    munmap(s, sizeof(dumpStream));
+    return result;
+}
+
+/* heapDumpWriter for heap_dump(), 'arg' points to the fd. */
+static int write_fd(void *arg, const void *data, size_t size) {
+
+    int fd = *(int*)arg;
+
+    while (size != 0) {
+        ssize_t n = write(fd, data, size);
+
+        if (n < 0) {
+            return -1;
+        }
+        data = (const char*)data + n;
+        size -= n;
+    }
+    return 0;
+}
+
+/*
+ * Streams a dump of every arena and the large blocks to file descriptor
+ * 'fd', see heap_dump_to().
+ * Returns 0 on success.
+ * Returns -1 on failure.
+ */
+int heap_dump(int fd, int format) {
+    return heap_dump_to(write_fd, &fd, format);
+}
+
+/*
+ * Consistency checks.
+ *
+ * Every block is checked against the rules in blockHeader: a size that is
+ * a multiple of ALIGNMENT and stays inside the heap, no m-bit, a p-bit that
+ * matches the a-bit of the block before it, a footer matching the header of
+ * every free block, and never two free blocks next to each other.  Each free
+ * block must be linked into the list of its size class, and the walk must
+ * land exactly on the end mark at alloc_size.
+ * The first problem found is reported on stderr.
+ */
+static int check_next;      // arena the next heap_check_step() looks at
+static pthread_mutex_t check_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Reports problem 'what' with block 'block' of arena 'h', or with the
+ * arena as a whole when 'block' is NULL.
+ * Returns -1.
+ */
+static int check_fail(heap_t *h, blockHeader *block, const char *what) {
+
+    int count = atomic_load_explicit(&num_arenas, memory_order_acquire);
+    int index = 0;
+
+    while (index < count && arenas[index] != h) {
+        index++;
+    }
+
+    // Heaps from heap_create() are not in arenas[].
+    char name[32];
+
+    if (index < count) {
+        snprintf(name, sizeof(name), "arena %d", index);
+    } else {
+        snprintf(name, sizeof(name), "heap %p", (void*)h);
+    }
+
+    if (block == NULL) {
+        fprintf(stderr, "heap_check: %s: %s\n", name, what);
+    } else {
+        fprintf(stderr, "heap_check: %s, block at offset %zu: %s\n",
+                name, (size_t)block_offset(h, block), what);
+    }
+    return -1;
+}
+
+/*
+ * Checks that the size of block 'block' of arena 'h' is valid, so that
+ * the next block can be found from it.
+ * Returns 0 if it is, -1 if not.
+ */
+static int check_size(heap_t *h, blockHeader *block) {
+
+    size_t size = (block->size_status) & sMask;
+    size_t room = (char*)h->heap_start + h->alloc_size - (char*)block;
+
+    if (size < MIN_BLOCK_SIZE || size % ALIGNMENT != 0 || size > room) {
+        return check_fail(h, block, "size out of range");
+    }
+    return 0;
+}
+
+/*
+ * Checks that free list offset 'offset' of arena 'h' is a free block of
+ * size class 'cls'.
+ * Returns 1 if it is, 0 if not.
+ */
+static int check_link(heap_t *h, blockWord offset, int cls) {
+
+    if (offset < HEADER_SIZE || offset >= HEADER_SIZE + h->alloc_size ||
+        (offset - HEADER_SIZE) % ALIGNMENT != 0) {
+        return 0;
+    }
+
+    blockHeader *block = offset_block(h, offset);
+
+    return ((block->size_status) & aBit) == 0 &&
+           size_class((block->size_status) & sMask) == cls;
+}
+
+/*
+ * Checks the footer and free list links of free block 'block' of arena 'h'.
+ * Returns 0 if they are consistent, -1 if not.
+ */
+static int check_free_block(heap_t *h, blockHeader *block) {
+
+    size_t size = (block->size_status) & sMask;
+    int cls = size_class(size);
+    blockWord self = block_offset(h, block);
+    freeLinks *links = links_of(block);
+
+    if (((blockHeader*)((char*)block + size) - 1)->size_status != size) {
+        return check_fail(h, block, "footer does not match header");
+    }
+    if ((h->class_map[cls / 64] & ((uint64_t)1 << (cls % 64))) == 0) {
+        return check_fail(h, block, "size class of free block marked empty");
+    }
+
+    if (links->prev == 0) {
+        if (h->free_lists[cls] != self) {
+            return check_fail(h, block, "free block without a previous link is not list head");
+        }
+    } else if (!check_link(h, links->prev, cls) ||
+               links_of(offset_block(h, links->prev))->next != self) {
+        return check_fail(h, block, "previous free list link is broken");
+    }
+
+    if (links->next != 0 &&
+        (!check_link(h, links->next, cls) ||
+         links_of(offset_block(h, links->next))->prev != self)) {
+        return check_fail(h, block, "next free list link is broken");
+    }
+    return 0;
+}
+
+/*
+ * Checks block 'block' of arena 'h', which follows block 'prev', or is
+ * heap_start when 'prev' is NULL.  'block' may be the end mark.
+ * The caller must hold h->lock.
+ * Returns 0 if it is consistent, -1 if not.
+ */
+static int check_block(heap_t *h, blockHeader *prev, blockHeader *block) {
 
-    while (current->size_status != 1) {
-        t_begin = (char*)current;
-        t_size = current->size_status;
+    int prevUsed = prev == NULL || ((prev->size_status) & aBit) != 0;
 
-        if (t_size & 1) {
-            // LSB = 1 => used block
-            strcpy(status, "alloc");
-            is_used = 1;
-            t_size = t_size - 1;
+    if ((((block->size_status) & pBit) != 0) != prevUsed) {
+        return check_fail(h, block, "p-bit does not match the previous block");
+    }
+
+    if ((char*)block == (char*)h->heap_start + h->alloc_size) {
+        if (((block->size_status) & ~pBit) != aBit) {
+            return check_fail(h, block, "end mark is not an allocated block of size 0");
+        }
+        return 0;
+    }
+
+    if (((block->size_status) & mBit) != 0) {
+        return check_fail(h, block, "m-bit set on a heap block");
+    }
+    if (check_size(h, block) != 0) {
+        return -1;
+    }
+    if (((block->size_status) & aBit) != 0) {
+        return 0;
+    }
+    if (!prevUsed) {
+        return check_fail(h, block, "free block follows a free block");
+    }
+    return check_free_block(h, block);
+}
+
+/*
+ * Checks that the size class bitmap of arena 'h' marks exactly the
+ * non-empty free lists.
+ * Returns 0 if it does, -1 if not.
+ */
+static int check_class_map(heap_t *h) {
+
+    for (int cls = 0; cls < (int)NUM_CLASSES; cls++) {
+        int marked = (h->class_map[cls / 64] >> (cls % 64)) & 1;
+
+        if (marked != (h->free_lists[cls] != 0)) {
+            return check_fail(h, NULL, "size class bitmap does not match the free lists");
+        }
+    }
+
+    for (int word = 0; word < (int)CLASS_WORDS; word++) {
+        if (((h->class_summary >> word) & 1) != (h->class_map[word] != 0)) {
+            return check_fail(h, NULL, "size class summary does not match the bitmap");
+        }
+    }
+    return 0;
+}
+
+/*
+ * Checks every block and free list of arena 'h', and that its counters
+ * match what is in the heap.
+ * The caller must hold h->lock.
+ * Returns 0 if it is consistent, -1 if not.
+ */
+static int check_arena(heap_t *h) {
+
+    char *end = (char*)h->heap_start + h->alloc_size;
+    blockHeader *prev = NULL;
+    blockHeader *block = h->heap_start;
+    size_t freeBlocks = 0, freeBytes = 0, usedBlocks = 0;
+    int roverSeen = 0, cursorSeen = h->check_last == NULL;
+
+    for (;;) {
+        if (check_block(h, prev, block) != 0) {
+            return -1;
+        }
+        if ((char*)block == end) {
+            break;
+        }
+
+        size_t size = (block->size_status) & sMask;
+
+        if (((block->size_status) & aBit) == 0) {
+            freeBlocks++;
+            freeBytes += size;
         } else {
-            strcpy(status, "FREE ");
-            is_used = 0;
+            usedBlocks++;
         }
+        roverSeen |= block == h->rover;
+        cursorSeen |= block == h->check_last;
 
-        if (t_size & 2) {
-            strcpy(p_status, "alloc");
-            t_size = t_size - 2;
+        prev = block;
+        block = (blockHeader*)((char*)block + size);
+    }
+
+    if (freeBlocks != h->free_blocks || freeBytes != h->free_bytes ||
+        usedBlocks != h->used_blocks) {
+        return check_fail(h, NULL, "block counters do not match the heap");
+    }
+    if (!roverSeen || !cursorSeen) {
+        return check_fail(h, NULL, "rover or check cursor is not on a block");
+    }
+    if (check_class_map(h) != 0) {
+        return -1;
+    }
+
+    // Every free block links back to its neighbours, so the lists only
+    // have to be counted, with a bound in case one loops.
+    size_t listed = 0;
+
+    for (int cls = 0; cls < (int)NUM_CLASSES; cls++) {
+        for (blockWord offset = h->free_lists[cls]; offset != 0;
+             offset = links_of(offset_block(h, offset))->next) {
+            if (!check_link(h, offset, cls)) {
+                return check_fail(h, NULL, "free list holds a block that is not in it");
+            }
+            if (++listed > freeBlocks) {
+                return check_fail(h, NULL, "free lists hold more blocks than the heap");
+            }
+        }
+    }
+    if (listed != freeBlocks) {
+        return check_fail(h, NULL, "free lists miss free blocks");
+    }
+    return 0;
+}
+
+/*
+ * Checks the list of large blocks and their headers.
+ * Returns 0 if it is consistent, -1 if not.
+ */
+static int check_large() {
+
+    int result = 0;
+    size_t count = 0, bytes = 0;
+    largeBlock *prev = NULL;
+
+    pthread_mutex_lock(&large_lock);
+
+    for (largeBlock *large = large_blocks; large != NULL; large = large->next) {
+        blockHeader *header = (blockHeader*)((char*)large + LARGE_OFFSET) - 1;
+
+        if (large->prev != prev || (header->size_status) != (aBit | mBit) ||
+            large->map_size % page_size != 0 || ++count > large_count) {
+            fprintf(stderr, "heap_check: large block at %p is corrupt\n", (void*)large);
+            result = -1;
+            break;
+        }
+        bytes += large->map_size;
+        prev = large;
+    }
+
+    if (result == 0 && (count != large_count || bytes != large_bytes)) {
+        fprintf(stderr, "heap_check: large block counters do not match the list\n");
+        result = -1;
+    }
+
+    pthread_mutex_unlock(&large_lock);
+    return result;
+}
+
+/*
+ * Checks the whole allocator: every block, free list and counter of
+ * every arena, and the large blocks.  Each arena is locked while it is
+ * walked, so this pauses its threads for time linear in its size; use
+ * heap_check_step() on a live process.
+ * Heaps from heap_create() are not included, see heap_check_of().
+ * Returns 0 if everything is consistent.
+ * Returns -1 after reporting the first problem found on stderr.
+ */
+int heap_check() {
+
+    int count = atomic_load_explicit(&num_arenas, memory_order_acquire);
+
+    for (int i = 0; i < count; i++) {
+        pthread_mutex_lock(&arenas[i]->lock);
+        int result = check_arena(arenas[i]);
+        pthread_mutex_unlock(&arenas[i]->lock);
+
+        if (result != 0) {
+            return -1;
+        }
+    }
+    return check_large();
+}
+
+/*
+ * Checks every block, free list and counter of heap 'h', as heap_check()
+ * does for the default heap, with 'h' locked while it is walked.
+ * Returns 0 if everything is consistent.
+ * Returns -1 after reporting the first problem found on stderr.
+ */
+int heap_check_of(heap_t *h) {
+
+    pthread_mutex_lock(&h->lock);
+    int result = check_arena(h);
+    pthread_mutex_unlock(&h->lock);
+
+    return result;
+}
+
+/*
+ * Checks at most 'blocks' more blocks, carrying on where the last call
+ * stopped.  Calls go through the arenas one after the other, so an arena
+ * lock is never held for more than 'blocks' blocks, and calling this
+ * regularly keeps every block of a live process under check.
+ * Blocks are checked as heap_check() does, except for the counters and
+ * the free list walk.  Once a step reaches the end mark of an arena, the
+ * arena's size class bitmap is checked and the next call starts on the
+ * next arena.
+ * Returns 1 when this call finished a pass over all arenas.
+ * Returns 0 when the pass is not finished.
+ * Returns -1 after reporting a problem on stderr; the arena is then
+ * checked again from its start.
+ */
+int heap_check_step(size_t blocks) {
+
+    int count = atomic_load_explicit(&num_arenas, memory_order_acquire);
+
+    if (count == 0) {
+        return 1;
+    }
+
+    pthread_mutex_lock(&check_lock);
+
+    heap_t *h = arenas[check_next % count];
+    char *end;
+    int result = 0;
+
+    pthread_mutex_lock(&h->lock);
+
+    end = (char*)h->heap_start + h->alloc_size;
+
+    // The last block checked may have changed since, so its size is
+    // checked again before it is used to find the next block.
+    blockHeader *prev = h->check_last;
+
+    if (prev != NULL && check_size(h, prev) != 0) {
+        result = -1;
+    }
+
+    for (size_t n = 0; n < blocks && result == 0; n++) {
+        blockHeader *block = prev == NULL ? h->heap_start :
+                             (blockHeader*)((char*)prev + ((prev->size_status) & sMask));
+
+        if (check_block(h, prev, block) != 0) {
+            result = -1;
+        } else if ((char*)block == end) {
+            result = check_class_map(h);
+            check_next = (check_next + 1) % count;
+            if (result == 0 && check_next == 0) {
+                result = 1;
+            }
+            prev = NULL;
+            break;
         } else {
-            strcpy(p_status, "FREE ");
+            prev = block;
         }
+    }
 
-        if (is_used) 
-            used_size += t_size;
-        else 
-            free_size += t_size;
+    h->check_last = result < 0 ? NULL : prev;
 
-        t_end = t_begin + t_size - 1;
+    pthread_mutex_unlock(&h->lock);
+    pthread_mutex_unlock(&check_lock);
 
-        fprintf(stdout, "%d\t%s\t%s\t0x%08lx\t0x%08lx\t%4i\n", counter, status, 
-                p_status, (unsigned long int)t_begin, (unsigned long int)t_end, t_size);
+    return result;
+}
 
-        current = (blockHeader*)((char*)current + t_size);
-        counter = counter + 1;
+/*
+ * Heap files.
+ *
+ * init_heap_file() maps the heap from a file with MAP_SHARED instead of
+ * anonymous memory, so that its blocks outlive the process and
+ * reopen_heap_file() can pick them up again in a later run.  The file is
+ * the region of the only arena, see create_arena(): its heap_t and
+ * heapFile, then the blocks with their headers, footers and end mark.
+ * Free list links are offsets from the heap start already, so nothing in
+ * the blocks depends on the address the file is mapped at.  Pointers kept
+ * in heap_t are set again on reopen, and data in allocated blocks has to
+ * refer to other blocks by offset too, see heap_offset() and
+ * heap_pointer().  heap_root() and heap_set_root() keep the offset of one
+ * block in the file, to find everything else from.
+ * A file under /dev/shm is a POSIX shared memory object, which survives
+ * restarts of the process but not of the machine.
+ */
+
+/*
+ * Opens heap file 'path' for reading and writing with open() flags
+ * 'flags', and takes an exclusive lock on it that is held until the
+ * process exits, so no other process maps the same heap.
+ * Returns the file descriptor, or -1 on failure.
+ */
+static int open_heap_file(const char *path, int flags) {
+
+    int fd = open(path, O_RDWR | O_CLOEXEC | flags, 0600);
+
+    if (fd < 0) {
+        fprintf(stderr, "Error: mem.c: cannot open heap file %s\n", path);
+        return -1;
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        fprintf(stderr, "Error: mem.c: heap file %s is in use\n", path);
+        close(fd);
+        return -1;
     }
+    return fd;
+}
 
-    fprintf(stdout, 
-            "--------------------------------------------------------------------------------\n");
-    fprintf(stdout, 
-            "********************************************************************************\n");
-    fprintf(stdout, "Total used size = %4d\n", used_size);
-    fprintf(stdout, "Total free size = %4d\n", free_size);
-    fprintf(stdout, "Total size      = %4d\n", used_size + free_size);
-    fprintf(stdout, 
-            "********************************************************************************\n");
-    fflush(stdout);
+/*
+ * Rebuilds the free lists and block counters of arena 'h' from its
+ * blocks, then checks the whole arena as heap_check() does.
+ * The caller must make 'h' arenas[0] first, for the error messages.
+ * Returns 0 if the arena is consistent, -1 if not.
+ */
+static int rebuild_arena(heap_t *h) {
 
-    return;  
-}            
-                                       
+    char *end = (char*)h->heap_start + h->alloc_size;
+    blockHeader *block = h->heap_start;
+
+    memset(h->free_lists, 0, sizeof(h->free_lists));
+    memset(h->class_map, 0, sizeof(h->class_map));
+    h->class_summary = 0;
+    h->free_bytes = 0;
+    h->free_blocks = 0;
+    h->used_blocks = 0;
+
+    while ((char*)block != end) {
+        if (check_size(h, block) != 0) {
+            return -1;
+        }
+        if (((block->size_status) & aBit) == 0) {
+            list_insert(h, block);
+        } else {
+            h->used_blocks++;
+        }
+        block = (blockHeader*)((char*)block + ((block->size_status) & sMask));
+    }
+    return check_arena(h);
+}
+
+/*
+ * Maps heap file 'fd', written by init_heap_file(), as the first arena.
+ * The heap keeps its size and can grow up to heap_config.max_size.
+ * Returns the arena, or NULL if the file is not a heap written by this
+ * build or its blocks are inconsistent.
+ */
+static heap_t* map_heap_file(int fd) {
+
+    size_t hdrsize = REGION_HEADER_SIZE(page_size);
+    struct stat st;
+    heapFile file;
+
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < hdrsize + page_size ||
+        st.st_size % page_size != 0 ||
+        pread(fd, &file, sizeof(file), sizeof(heap_t)) != sizeof(file) ||
+        memcmp(file.magic, HEAP_FILE_MAGIC, sizeof(file.magic)) != 0 ||
+        file.version != HEAP_FILE_VERSION || file.header_size != HEADER_SIZE ||
+        file.arena_size != sizeof(heap_t)) {
+        fprintf(stderr, "Error: mem.c: not a heap file of this build\n");
+        return NULL;
+    }
+
+    size_t size = st.st_size;
+    size_t reserve = hdrsize + heap_config.max_size;
+
+    if (reserve < size) {
+        reserve = size;
+    }
+
+    void *mmap_ptr = mmap(NULL, reserve, PROT_NONE, MAP_SHARED, fd, 0);
+
+    if (MAP_FAILED == mmap_ptr) {
+        fprintf(stderr, "Error:mem.c: mmap cannot map the heap file\n");
+        return NULL;
+    }
+    if (mprotect(mmap_ptr, size, PROT_READ | PROT_WRITE) != 0) {
+        fprintf(stderr, "Error:mem.c: mprotect cannot commit space\n");
+        munmap(mmap_ptr, reserve);
+        return NULL;
+    }
+
+    heap_t *h = (heap_t*) mmap_ptr;
+
+    // Everything but the heap size is set again, the rest of the heap_t
+    // is either rebuilt from the blocks or only meant for one process.
+    pthread_mutex_init(&h->lock, NULL);
+    h->config = heap_config;
+    h->fd = fd;
+    h->heap_start = (blockHeader*) ((char*)mmap_ptr + hdrsize) + 1;
+    h->map_size = size;
+    h->reserve_size = reserve;
+    h->region_page = page_size;
+    h->threads = 0;
+    h->node = 0;
+    atomic_init(&h->remote_frees, NULL);
+    h->rover = h->heap_start;
+    h->check_last = NULL;
+
+    h->alloc_calls = 0;
+    h->free_calls = 0;
+    h->failed_allocs = 0;
+    h->splits = 0;
+    h->coalesces = 0;
+    memset(&h->profile, 0, sizeof(h->profile));
+
+    arenas[0] = h;
+
+    if (h->alloc_size < MIN_BLOCK_SIZE || h->alloc_size % ALIGNMENT != 0 ||
+        h->alloc_size > size - hdrsize - 2 * HEADER_SIZE || rebuild_arena(h) != 0) {
+        fprintf(stderr, "Error: mem.c: heap file is corrupt\n");
+        arenas[0] = NULL;
+        munmap(mmap_ptr, reserve);
+        return NULL;
+    }
+    return h;
+}
+
+/*
+ * Initializes the memory allocator with a heap in file 'path', created
+ * or emptied first, instead of anonymous memory.  See "Heap files" above.
+ * Called once by a program, instead of init_heap_ex().
+ * Argument config: as for init_heap_ex().  The file is extended and cut
+ * as the heap grows and shrinks.  Every block is placed in the heap,
+ * in normal pages: mmap_threshold and pages are ignored.
+ * All threads share the one arena, and the thread cache is not used.
+ * The file stays locked until the process exits.
+ * Returns 0 on success.
+ * Returns -1 on failure.
+ */
+int init_heap_file(const char *path, const heapConfig *config) {
+
+    if (set_config(config) != 0) {
+        return -1;
+    }
+    heap_config.mmap_threshold = 0;
+    heap_config.pages = P3HEAP_PAGES_NORMAL;
+
+    int fd = open_heap_file(path, O_CREAT);
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    // Only cut the file once it is locked, and drop every old page.
+    heap_t *h = ftruncate(fd, 0) == 0 ? create_arena(&heap_config, 0, fd) : NULL;
+
+    if (h == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    heapFile *file = file_of(h);
+
+    memcpy(file->magic, HEAP_FILE_MAGIC, sizeof(file->magic));
+    file->version = HEAP_FILE_VERSION;
+    file->header_size = HEADER_SIZE;
+    file->arena_size = sizeof(heap_t);
+    file->root = 0;
+
+    heap_fd = fd;
+    start_heap(h);
+
+    return 0;
+}
+
+/*
+ * Initializes the memory allocator with the heap in file 'path', written
+ * by init_heap_file() in an earlier run of a program built the same way.
+ * Every block is checked, the free lists are rebuilt from them, and
+ * allocated blocks keep their contents, at whatever address the file is
+ * mapped now.  The heap continues as set up by init_heap_file() with
+ * 'config', except that it keeps its current size.
+ * Called once by a program, instead of init_heap_ex().
+ * Returns 0 on success.
+ * Returns -1 if the file cannot be mapped, is not a heap file of this
+ * build, or its blocks are inconsistent.
+ */
+int reopen_heap_file(const char *path, const heapConfig *config) {
+
+    if (set_config(config) != 0) {
+        return -1;
+    }
+    heap_config.mmap_threshold = 0;
+    heap_config.pages = P3HEAP_PAGES_NORMAL;
+
+    int fd = open_heap_file(path, 0);
+
+    if (fd < 0) {
+        return -1;
+    }
+
+    heap_t *h = map_heap_file(fd);
+
+    if (h == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    heap_fd = fd;
+    start_heap(h);
+
+    return 0;
+}
+
+/*
+ * Writes the heap file back to disk and waits until it is there, so that
+ * the heap also survives a crash of the O.S.  Without it the O.S. writes
+ * it back in its own time, which is enough for a restart of the process.
+ * Returns 0 on success.
+ * Returns -1 if there is no heap file or it cannot be written.
+ */
+int heap_sync() {
+
+    if (heap_fd < 0) {
+        return -1;
+    }
+
+    heap_t *h = arenas[0];
+
+    pthread_mutex_lock(&h->lock);
+    int result = msync(h, h->map_size, MS_SYNC);
+    pthread_mutex_unlock(&h->lock);
+
+    return result == 0 ? 0 : -1;
+}
+
+/*
+ * Returns the offset of 'ptr' in the first arena's region, which stays
+ * the same when a heap file is mapped at another address.
+ * Returns 0 for NULL, or a pointer outside that arena's heap.
+ */
+size_t heap_offset(const void *ptr) {
+
+    if (atomic_load_explicit(&num_arenas, memory_order_acquire) == 0 ||
+        !heap_contains(arenas[0], (void*)ptr)) {
+        return 0;
+    }
+    return (char*)ptr - (char*)arenas[0];
+}
+
+/*
+ * Returns the address of 'offset', as returned by heap_offset(), in the
+ * first arena's region.
+ * Returns NULL for offset 0.
+ */
+void* heap_pointer(size_t offset) {
+
+    if (offset == 0 || atomic_load_explicit(&num_arenas, memory_order_acquire) == 0) {
+        return NULL;
+    }
+    return (char*)arenas[0] + offset;
+}
+
+/*
+ * Returns the root block set by heap_set_root(), or NULL if there is
+ * none.  Of a heap file it is the block last set as root in any run.
+ */
+void* heap_root() {
+
+    if (atomic_load_explicit(&num_arenas, memory_order_acquire) == 0) {
+        return NULL;
+    }
+    return heap_pointer(__atomic_load_n(&file_of(arenas[0])->root, __ATOMIC_ACQUIRE));
+}
+
+/*
+ * Makes 'ptr', a block of the first arena's heap, or NULL, the root
+ * returned by heap_root().
+ * Returns 0 on success.
+ * Returns -1 if 'ptr' is not in that heap.
+ */
+int heap_set_root(void *ptr) {
+
+    size_t offset = heap_offset(ptr);
+
+    if (atomic_load_explicit(&num_arenas, memory_order_acquire) == 0 ||
+        (offset == 0 && ptr != NULL)) {
+        return -1;
+    }
+    __atomic_store_n(&file_of(arenas[0])->root, offset, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+ * fork() handlers, for pthread_atfork().
+ *
+ * heap_fork_prepare() takes every lock of the allocator, so that no other
+ * thread holds one while the process is copied, and heap_fork_parent()
+ * and heap_fork_child() release them again.  The locks are taken in the
+ * order the allocator nests them: the trace and quarantine locks, then
+ * arena_lock, every arena in turn and the large block list.
+ * The child has only the thread that forked: it stops recording a
+ * trace, whose flusher thread did not survive and whose file belongs to
+ * the parent, and gives up the trace rings of the parent's other threads.
+ * Heaps from heap_create() are not locked, so a child must not use one
+ * that another thread may have been using when it forked.
+ */
+void heap_fork_prepare() {
+
+    pthread_mutex_lock(&trace_lock);
+#ifdef P3HEAP_DEBUG
+    pthread_mutex_lock(&quarantine_lock);
+#endif
+    pthread_mutex_lock(&check_lock);
+    pthread_mutex_lock(&arena_lock);
+
+    int count = atomic_load_explicit(&num_arenas, memory_order_acquire);
+
+    for (int i = 0; i < count; i++) {
+        pthread_mutex_lock(&arenas[i]->lock);
+    }
+    pthread_mutex_lock(&large_lock);
+}
+
+/* Releases the locks of heap_fork_prepare(), in the reverse order. */
+static void fork_unlock() {
+
+    pthread_mutex_unlock(&large_lock);
+    for (int i = atomic_load_explicit(&num_arenas, memory_order_acquire) - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&arenas[i]->lock);
+    }
+    pthread_mutex_unlock(&arena_lock);
+    pthread_mutex_unlock(&check_lock);
+#ifdef P3HEAP_DEBUG
+    pthread_mutex_unlock(&quarantine_lock);
+#endif
+    pthread_mutex_unlock(&trace_lock);
+}
+
+void heap_fork_parent() {
+    fork_unlock();
+}
+
+void heap_fork_child() {
+
+    if (trace_fd != -1) {
+        __atomic_store_n(&tracing, 0, __ATOMIC_RELEASE);
+        close(trace_fd);
+        trace_fd = -1;
+    }
+    trace_stopping = 0;
+
+    // The parent writes out what the rings hold.
+    for (traceRing *ring = atomic_load_explicit(&trace_rings, memory_order_acquire);
+         ring != NULL; ring = ring->next) {
+        atomic_store_explicit(&ring->tail, atomic_load(&ring->head), memory_order_relaxed);
+        atomic_store_explicit(&ring->dropped, 0, memory_order_relaxed);
+        if (ring != thread_ring) {
+            atomic_store_explicit(&ring->in_use, 0, memory_order_relaxed);
+        }
+    }
+
+    fork_unlock();
+}
@@ -2,15 +2,324 @@
 #ifndef __p3Heap_h
 #define __p3Heap_h
 
-int   init_heap(int sizeOfRegion);
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Alignment of every payload, which depends on -DP3HEAP_64BIT. */
+#ifdef P3HEAP_64BIT
+#define P3HEAP_ALIGNMENT 16
+#else
+#define P3HEAP_ALIGNMENT 8
+#endif
+
+/* Largest a heap set up by init_heap() can grow to. */
+#ifndef P3HEAP_DEFAULT_MAX
+#define P3HEAP_DEFAULT_MAX ((size_t)1 << 30)
+#endif
+
+/* Free block size at which a heap set up by init_heap() is trimmed. */
+#ifndef P3HEAP_DEFAULT_TRIM
+#define P3HEAP_DEFAULT_TRIM ((size_t)16 << 20)
+#endif
+
+/* Request size from which init_heap() maps each block on its own. */
+#ifndef P3HEAP_DEFAULT_MMAP
+#define P3HEAP_DEFAULT_MMAP ((size_t)128 << 10)
+#endif
+
+/* Cache line size that alloc_isolated() and heapConfig.isolate place by. */
+#ifndef P3HEAP_CACHE_LINE
+#define P3HEAP_CACHE_LINE 64
+#endif
+
+/*
+ * Placement policies for heapConfig.placement.
+ * P3HEAP_GOOD_FIT  takes a block at most one size class above the best fit
+ *                  in bounded time, the default.
+ * P3HEAP_FIRST_FIT takes the first block that fits in the request's size
+ *                  class, before looking at larger classes.
+ * P3HEAP_NEXT_FIT  takes the next free block that fits in address order,
+ *                  starting where the last allocation left off.
+ * P3HEAP_BEST_FIT  takes the smallest block that fits.
+ */
+typedef enum placementPolicy {
+    P3HEAP_GOOD_FIT = 0,
+    P3HEAP_FIRST_FIT,
+    P3HEAP_NEXT_FIT,
+    P3HEAP_BEST_FIT
+} placementPolicy;
+
+/*
+ * Pages backing each arena's region, for heapConfig.pages.
+ * P3HEAP_PAGES_NORMAL      the O.S. page size, the default.
+ * P3HEAP_PAGES_TRANSPARENT normal pages marked MADV_HUGEPAGE, so the O.S.
+ *                          can back them with 2 MiB transparent huge pages.
+ * P3HEAP_PAGES_HUGE_2M     2 MiB MAP_HUGETLB pages from the O.S. pool.
+ * P3HEAP_PAGES_HUGE_1G     1 GiB MAP_HUGETLB pages from the O.S. pool.
+ * With huge pages the heap is committed, grown and trimmed in whole huge
+ * pages.  MAP_HUGETLB regions need max_size worth of pages in the pool and
+ * fall back to P3HEAP_PAGES_TRANSPARENT when there are not enough.
+ */
+typedef enum heapPages {
+    P3HEAP_PAGES_NORMAL = 0,
+    P3HEAP_PAGES_TRANSPARENT,
+    P3HEAP_PAGES_HUGE_2M,
+    P3HEAP_PAGES_HUGE_1G
+} heapPages;
+
+/*
+ * Heap sizes for init_heap_ex(), in bytes.
+ * The heap maps initial_size bytes and grows on demand up to max_size.
+ * Each time it grows it adds at least grow_size bytes, or doubles in size
+ * when grow_size is 0.  A max_size not above initial_size disables growth.
+ * Whenever a free of a block leaves a free block of at least trim_threshold
+ * bytes, its pages are given back to the O.S.; 0 disables this.
+ * Requests of at least mmap_threshold bytes are not placed in the heap but
+ * get a mapping of their own; 0 disables this.
+ * placement selects how a free block is chosen, see placementPolicy.
+ * With isolate set every block is placed on cache lines of its own, as
+ * by alloc_isolated(), so blocks used by different threads never share
+ * a line.
+ * pages selects the pages the heap is backed by, see heapPages.
+ */
+typedef struct heapConfig {
+    size_t initial_size;
+    size_t max_size;
+    size_t grow_size;
+    size_t trim_threshold;
+    size_t mmap_threshold;
+    placementPolicy placement;
+    int isolate;
+    heapPages pages;
+} heapConfig;
+
+/*
+ * Snapshot of the allocator's counters, see heap_stats().
+ * Byte counts include block headers and footers.  Blocks with their own
+ * mapping are only counted in large_blocks and large_bytes.
+ * largest_free is the size of a free block in the size class of the
+ * largest one, see heap_class_size(): exact when that class holds a single
+ * block, otherwise less than an eighth below it; heap_dump() has the exact
+ * size.
+ * fragmentation is 1 - largest_free / free_bytes: 0 when all free memory
+ * is in one block, close to 1 when it is scattered over small blocks.
+ */
+typedef struct heapStats {
+    size_t heap_bytes;          // bytes of blocks in all heaps
+    size_t allocated_bytes;     // bytes in allocated blocks
+    size_t free_bytes;          // bytes in free blocks
+    size_t allocated_blocks;
+    size_t free_blocks;
+    size_t largest_free;        // largest free block, to within its class
+    size_t large_blocks;        // number of blocks with their own mapping
+    size_t large_bytes;         // bytes mapped for them
+    size_t alloc_calls;         // alloc() calls, including failed ones
+    size_t free_calls;          // successful free_block() calls
+    size_t failed_allocs;       // alloc() calls that returned NULL
+    size_t splits;              // blocks split into two
+    size_t coalesces;           // blocks merged with a free neighbour
+    double fragmentation;
+} heapStats;
+
+/*
+ * Histograms collected while profiling is on, see heap_profile_enable().
+ * sizes counts alloc() requests by the size class of their block, see
+ * heap_class_size() for the bounds.  The others use power of two buckets:
+ * bucket 0 counts zeros and bucket i values in [2^(i-1), 2^i), with the
+ * last bucket taking everything above.
+ * alloc_ns and free_ns hold the sampled latencies in nanoseconds, walked
+ * the number of blocks each search of a heap looked at.
+ */
+#define P3HEAP_SIZE_BUCKETS    512
+#define P3HEAP_LATENCY_BUCKETS 32
+#define P3HEAP_WALK_BUCKETS    24
+
+typedef struct heapProfile {
+    size_t sizes[P3HEAP_SIZE_BUCKETS];
+    size_t alloc_ns[P3HEAP_LATENCY_BUCKETS];
+    size_t free_ns[P3HEAP_LATENCY_BUCKETS];
+    size_t walked[P3HEAP_WALK_BUCKETS];
+} heapProfile;
+
+/*
+ * Formats for heap_dump().
+ *
+ * P3HEAP_DUMP_JSON writes one object:
+ *   {"arenas":[{"index":0,"heap_bytes":..,"free_bytes":..,"free_blocks":..,
+ *               "largest_free":..,"blocks":[[offset,size,a,p],...]},...],
+ *    "large":{"bytes":..,"blocks":[[0,size,1,0],...]}}
+ * with a block's offset counted from the first block of its heap.
+ *
+ * P3HEAP_DUMP_BINARY writes a heapDumpHeader, then one heapDumpArena for
+ * each arena followed by its heapDumpBlock records, then a last
+ * heapDumpArena with index UINT32_MAX for the large blocks, in host byte
+ * order.  size_status is the block's header word: the size with the
+ * a-bit (1), p-bit (2) and, for large blocks, m-bit (4) in the low bits.
+ */
+#define P3HEAP_DUMP_JSON    0
+#define P3HEAP_DUMP_BINARY  1
+
+#define P3HEAP_DUMP_MAGIC   "P3HD"
+#define P3HEAP_DUMP_VERSION 1
+
+typedef struct heapDumpHeader {
+    char     magic[4];          // P3HEAP_DUMP_MAGIC, not terminated
+    uint32_t version;           // P3HEAP_DUMP_VERSION
+    uint32_t arenas;            // number of arena records, large excluded
+    uint32_t reserved;
+} heapDumpHeader;
+
+typedef struct heapDumpArena {
+    uint32_t index;
+    uint32_t reserved;
+    uint64_t heap_bytes;        // bytes of all blocks
+    uint64_t free_bytes;
+    uint64_t free_blocks;
+    uint64_t largest_free;
+    uint64_t blocks;            // number of heapDumpBlock records that follow
+} heapDumpArena;
+
+typedef struct heapDumpBlock {
+    uint64_t offset;
+    uint64_t size_status;
+} heapDumpBlock;
+
+/*
+ * Receives the next 'size' bytes of a dump.
+ * Returns 0 to go on, anything else to stop the dump.
+ */
+typedef int (*heapDumpWriter)(void *arg, const void *data, size_t size);
+
+/*
+ * Trace files written by heap_trace_start(): a heapTraceHeader followed by
+ * heapTraceRecord records in host byte order.  Records of one thread are
+ * in call order, records of different threads interleave by time_ns only
+ * roughly and have to be sorted by it.
+ */
+#define P3HEAP_TRACE_MAGIC   "P3TR"
+#define P3HEAP_TRACE_VERSION 1
+
+#define P3HEAP_TRACE_ALLOC   1      // ptr = alloc(size)
+#define P3HEAP_TRACE_FREE    2      // free_block(ptr)
+#define P3HEAP_TRACE_REALLOC 3      // ptr = realloc_block(old, size)
+
+typedef struct heapTraceHeader {
+    char     magic[4];              // P3HEAP_TRACE_MAGIC, not terminated
+    uint32_t version;               // P3HEAP_TRACE_VERSION
+    uint32_t record_size;           // sizeof(heapTraceRecord)
+    uint32_t reserved;
+} heapTraceHeader;
+
+typedef struct heapTraceRecord {
+    uint64_t time_ns;               // CLOCK_MONOTONIC time of the call
+    uint64_t ptr;                   // result, or block freed; 0 if alloc failed
+    uint64_t old;                   // block resized by P3HEAP_TRACE_REALLOC
+    uint64_t size;                  // requested size
+    uint32_t thread;                // O.S. thread id of the caller
+    uint32_t op;                    // P3HEAP_TRACE_ALLOC, _FREE or _REALLOC
+} heapTraceRecord;
+
+int   init_heap(size_t sizeOfRegion);
+int   init_heap_ex(const heapConfig *config);
+int   init_heap_file(const char *path, const heapConfig *config);
+int   reopen_heap_file(const char *path, const heapConfig *config);
 void  disp_heap();
 
-void* alloc(int size);
+void* alloc(size_t size);
+void* alloc_aligned(size_t size, size_t align);
+void* alloc_isolated(size_t size);
+size_t alloc_batch(size_t size, size_t n, void **out);
+int   free_batch(void **ptrs, size_t n);
 int   free_block(void *ptr);
 
-void* malloc(size_t size) {
-    return NULL;
+/*
+ * 'size' must be the size passed to the alloc() or realloc_block() call
+ * that returned the block, as for C23 free_sized().  Release builds trust
+ * it: small blocks go to the thread cache without their header being
+ * read, and a wrong size silently corrupts the heap.  Only builds with
+ * -DP3HEAP_DEBUG check it.
+ * Only blocks of up to 256 bytes, the thread cache's limit, of the
+ * calling thread's arena gain anything over free_block().  Any other
+ * block is freed by free_block(), which reads its header: coalescing
+ * needs the header's p-bit, and the block may be larger than 'size'
+ * makes it, so the size cannot stand in for the header.
+ */
+int   free_block_sized(void *ptr, size_t size);
+
+void* realloc_block(void *ptr, size_t newSize);
+size_t block_usable_size(void *ptr);
+size_t heap_trim();
+void  heap_stats(heapStats *stats);
+void  heap_profile_enable(unsigned sampleEvery);
+void  heap_profile(heapProfile *profile);
+size_t heap_class_size(int cls);
+int   heap_dump(int fd, int format);
+int   heap_dump_to(heapDumpWriter writer, void *arg, int format);
+int   heap_trace_start(const char *path);
+size_t heap_trace_stop();
+int   heap_check();
+int   heap_check_step(size_t blocks);
+int   heap_sync();
+size_t heap_offset(const void *ptr);
+void* heap_pointer(size_t offset);
+void* heap_root();
+int   heap_set_root(void *ptr);
+
+/*
+ * fork() handlers for pthread_atfork(), see heap_fork_prepare().
+ * Programs that fork while other threads allocate must register them;
+ * the malloc shim does.
+ */
+void  heap_fork_prepare();
+void  heap_fork_parent();
+void  heap_fork_child();
+
+/*
+ * Heap of its own, apart from the default heap of init_heap().
+ * See heap_create().
+ * These heaps are left out of heap_stats(), heap_profile(), heap_dump(),
+ * heap_check() and heap_check_step(), which only cover the default heap;
+ * heap_stats_of() and heap_check_of() report on one of them.
+ */
+typedef struct heap heap_t;
+
+heap_t* heap_create(const heapConfig *config);
+void* heap_alloc(heap_t *h, size_t size);
+void* heap_alloc_aligned(heap_t *h, size_t size, size_t align);
+int   heap_free(heap_t *h, void *ptr);
+void  heap_destroy(heap_t *h);
+void  heap_stats_of(heap_t *h, heapStats *stats);
+int   heap_check_of(heap_t *h);
+
+/*
+ * Pool of objects of one size, allocated without a header per object.
+ * See pool_create().
+ */
+typedef struct objPool objPool;
+
+objPool* pool_create(size_t objSize);
+void* pool_alloc(objPool *pool);
+void  pool_free(objPool *pool, void *ptr);
+void  pool_destroy(objPool *pool);
+
+/*
+ * Region of memory allocated by bumping a pointer and freed all at once.
+ * See region_create().
+ */
+typedef struct memRegion memRegion;
+
+memRegion* region_create(size_t bytes);
+void* region_alloc(memRegion *region, size_t size);
+void  region_reset(memRegion *region);
+void  region_destroy(memRegion *region);
+
+#ifdef __cplusplus
 }
+#endif
 
 #endif
 
@@ -0,0 +1,289 @@
+/*
+ * Dhruv Butani - Heap Allocator - UW Madison CS354
+ *
+ * C++ front end, header only, C++17:
+ *
+ *   PoolAllocator<T>    std allocator on the default heap, with sizes and
+ *                       the aligned or plain path fixed at compile time
+ *   HeapAllocator<T>    std allocator on a heap from heap_create()
+ *   RegionAllocator<T>  std allocator on a memRegion, freed by region_reset()
+ *   HeapResource        std::pmr::memory_resource on a heap from heap_create()
+ *   default_resource()  std::pmr::memory_resource on the default heap
+ *
+ * Every allocator frees with the size it allocated, so PoolAllocator goes
+ * through free_block_sized() and never decodes a block header.
+ * HeapAllocator and RegionAllocator follow their containers on copy and
+ * move assignment and on swap, so a moved container keeps its memory and
+ * frees it to the heap or region it came from.
+ * Allocation failures throw std::bad_alloc.
+ * Link with p3Heap.c, built with the same -DP3HEAP_64BIT setting.
+ */
+
+#ifndef __p3Heap_hpp
+#define __p3Heap_hpp
+
+#include <cstddef>
+#include <functional>
+#include <memory_resource>
+#include <new>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "p3Heap.h"
+
+namespace p3heap {
+
+/*
+ * Returns the bytes to allocate for 'n' objects of type T, at least 1 so
+ * that allocate(0) gets a block too.  Throws std::bad_array_new_length if
+ * they cannot be counted in a size_t.
+ */
+template <class T>
+constexpr std::size_t array_bytes(std::size_t n) {
+
+    if (n > static_cast<std::size_t>(-1) / sizeof(T)) {
+        throw std::bad_array_new_length();
+    }
+    return n == 0 ? 1 : n * sizeof(T);
+}
+
+/* Returns 'ptr', throwing std::bad_alloc if it is NULL. */
+inline void* checked(void *ptr) {
+
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+/*
+ * Allocator of the default heap, see alloc().
+ * Whether T needs alloc_aligned() and the size of a single object are
+ * compile-time constants, and objects are freed with free_block_sized():
+ * small objects go to the thread cache and come back from it without
+ * their headers being read or the arena lock being taken.
+ * Stateless, so any two PoolAllocators are equal.
+ */
+template <class T>
+class PoolAllocator {
+
+public:
+    using value_type = T;
+    using is_always_equal = std::true_type;
+
+    // Types aligned beyond what every payload gets take the aligned path.
+    static constexpr bool over_aligned = alignof(T) > P3HEAP_ALIGNMENT;
+
+    // Payload of a single object, what allocate(1) asks the heap for.
+    static constexpr std::size_t object_size = sizeof(T);
+
+    PoolAllocator() noexcept = default;
+
+    template <class U>
+    PoolAllocator(const PoolAllocator<U>&) noexcept {}
+
+    T* allocate(std::size_t n) {
+
+        std::size_t bytes = n == 1 ? object_size : array_bytes<T>(n);
+
+        if constexpr (over_aligned) {
+            return static_cast<T*>(checked(alloc_aligned(bytes, alignof(T))));
+        } else {
+            return static_cast<T*>(checked(alloc(bytes)));
+        }
+    }
+
+    void deallocate(T *ptr, std::size_t n) noexcept {
+        free_block_sized(ptr, n == 1 ? object_size : array_bytes<T>(n));
+    }
+
+    template <class U>
+    bool operator==(const PoolAllocator<U>&) const noexcept {
+        return true;
+    }
+
+    template <class U>
+    bool operator!=(const PoolAllocator<U>&) const noexcept {
+        return false;
+    }
+};
+
+/*
+ * Allocator of heap 'heap' from heap_create(), which must outlive every
+ * container using it.  Allocators of the same heap are equal.
+ */
+template <class T>
+class HeapAllocator {
+
+public:
+    using value_type = T;
+    using propagate_on_container_copy_assignment = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+    using is_always_equal = std::false_type;
+
+    explicit HeapAllocator(heap_t *heap) noexcept : heap_(heap) {}
+
+    template <class U>
+    HeapAllocator(const HeapAllocator<U> &other) noexcept : heap_(other.heap()) {}
+
+    heap_t* heap() const noexcept {
+        return heap_;
+    }
+
+    T* allocate(std::size_t n) {
+
+        std::size_t bytes = array_bytes<T>(n);
+
+        if constexpr (alignof(T) > P3HEAP_ALIGNMENT) {
+            return static_cast<T*>(checked(heap_alloc_aligned(heap_, bytes, alignof(T))));
+        } else {
+            return static_cast<T*>(checked(heap_alloc(heap_, bytes)));
+        }
+    }
+
+    void deallocate(T *ptr, std::size_t) noexcept {
+        heap_free(heap_, ptr);
+    }
+
+    template <class U>
+    bool operator==(const HeapAllocator<U> &other) const noexcept {
+        return heap_ == other.heap();
+    }
+
+    template <class U>
+    bool operator!=(const HeapAllocator<U> &other) const noexcept {
+        return heap_ != other.heap();
+    }
+
+private:
+    heap_t *heap_;
+};
+
+/*
+ * Allocator of region 'region' from region_create(), which must outlive
+ * every container using it.  deallocate() does nothing: the memory comes
+ * back all at once with region_reset() or region_destroy(), so it suits
+ * node containers and vectors that are filled and dropped together.
+ * Allocators of the same region are equal.
+ */
+template <class T>
+class RegionAllocator {
+
+    static_assert(alignof(T) <= P3HEAP_ALIGNMENT,
+                  "regions only align to P3HEAP_ALIGNMENT");
+
+public:
+    using value_type = T;
+    using propagate_on_container_copy_assignment = std::true_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+    using is_always_equal = std::false_type;
+
+    explicit RegionAllocator(memRegion *region) noexcept : region_(region) {}
+
+    template <class U>
+    RegionAllocator(const RegionAllocator<U> &other) noexcept : region_(other.region()) {}
+
+    memRegion* region() const noexcept {
+        return region_;
+    }
+
+    T* allocate(std::size_t n) {
+        return static_cast<T*>(checked(region_alloc(region_, array_bytes<T>(n))));
+    }
+
+    void deallocate(T*, std::size_t) noexcept {}
+
+    template <class U>
+    bool operator==(const RegionAllocator<U> &other) const noexcept {
+        return region_ == other.region();
+    }
+
+    template <class U>
+    bool operator!=(const RegionAllocator<U> &other) const noexcept {
+        return region_ != other.region();
+    }
+
+private:
+    memRegion *region_;
+};
+
+/* Containers of one heap or region, see HeapAllocator and RegionAllocator. */
+template <class T>
+using HeapVector = std::vector<T, HeapAllocator<T>>;
+
+template <class K, class V, class Hash = std::hash<K>, class Equal = std::equal_to<K>>
+using HeapUnorderedMap =
+    std::unordered_map<K, V, Hash, Equal, HeapAllocator<std::pair<const K, V>>>;
+
+template <class T>
+using RegionVector = std::vector<T, RegionAllocator<T>>;
+
+template <class K, class V, class Hash = std::hash<K>, class Equal = std::equal_to<K>>
+using RegionUnorderedMap =
+    std::unordered_map<K, V, Hash, Equal, RegionAllocator<std::pair<const K, V>>>;
+
+/*
+ * Memory resource of heap 'heap' from heap_create(), which must outlive
+ * the resource.  Resources of the same heap are equal.
+ */
+class HeapResource : public std::pmr::memory_resource {
+
+public:
+    explicit HeapResource(heap_t *heap) noexcept : heap_(heap) {}
+
+    heap_t* heap() const noexcept {
+        return heap_;
+    }
+
+private:
+    void* do_allocate(std::size_t bytes, std::size_t align) override {
+        // A unique block for 0 bytes, as malloc() gives.
+        return checked(heap_alloc_aligned(heap_, bytes == 0 ? 1 : bytes, align));
+    }
+
+    void do_deallocate(void *ptr, std::size_t, std::size_t) override {
+        heap_free(heap_, ptr);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+        const HeapResource *heap = dynamic_cast<const HeapResource*>(&other);
+        return heap != nullptr && heap->heap_ == heap_;
+    }
+
+    heap_t *heap_;
+};
+
+/* Memory resource of the default heap, see default_resource(). */
+class DefaultResource : public std::pmr::memory_resource {
+
+private:
+    void* do_allocate(std::size_t bytes, std::size_t align) override {
+        return checked(alloc_aligned(bytes == 0 ? 1 : bytes, align));
+    }
+
+    void do_deallocate(void *ptr, std::size_t bytes, std::size_t) override {
+        free_block_sized(ptr, bytes == 0 ? 1 : bytes);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override {
+        return dynamic_cast<const DefaultResource*>(&other) != nullptr;
+    }
+};
+
+/*
+ * Returns the memory resource of the default heap, for
+ * std::pmr::set_default_resource() or pmr containers.
+ * init_heap() must be called before it allocates.
+ */
+inline std::pmr::memory_resource* default_resource() noexcept {
+
+    static DefaultResource resource;
+    return &resource;
+}
+
+} // namespace p3heap
+
+#endif
@@ -0,0 +1,286 @@
+/*
+ * Dhruv Butani - Heap Allocator - UW Madison CS354
+ *
+ * malloc() family front end on top of alloc() and free_block(), meant to be
+ * built as a shared library and loaded with LD_PRELOAD:
+ *
+ *   gcc -O2 -fPIC -shared -DP3HEAP_64BIT -ftls-model=initial-exec -pthread \
+ *       p3Heap.c p3Malloc.c -o libp3malloc.so
+ *   LD_PRELOAD=./libp3malloc.so ./program
+ *
+ * The heap is set up on the first call.  Its sizes can be set with the
+ * P3HEAP_INITIAL and P3HEAP_MAX environment variables, in bytes.
+ * Setting P3HEAP_ISOLATE to 1 gives every block cache lines of its own,
+ * see heapConfig.isolate.  P3HEAP_PAGES set to "thp", "2m" or "1g" backs
+ * the heap with huge pages, see heapPages.
+ * With P3HEAP_TRACE set to a file name every call is recorded to that
+ * file, see heap_trace_start().  A "%p" in the name is replaced by the
+ * process id, so that child processes do not overwrite the same trace.
+ */
+
+#ifndef P3HEAP_64BIT
+#error "malloc() must return 16-byte aligned memory, build with -DP3HEAP_64BIT"
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "p3Heap.h"
+
+#define MALLOC_ALIGNMENT 16
+
+/* Defaults for the heap of every arena. */
+#define SHIM_INITIAL_SIZE ((size_t)4 << 20)
+#define SHIM_MAX_SIZE     ((size_t)64 << 30)
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static int init_failed;
+
+/* Reads a size from the environment, or returns 'fallback'. */
+static size_t env_size(const char *name, size_t fallback) {
+
+    const char *value = getenv(name);
+
+    if (value == NULL || *value == '\0') {
+        return fallback;
+    }
+
+    char *end;
+    unsigned long long size = strtoull(value, &end, 0);
+
+    return (*end == '\0' && size != 0) ? (size_t)size : fallback;
+}
+
+/* Reads the page mode for heapConfig.pages from P3HEAP_PAGES. */
+static heapPages env_pages() {
+
+    const char *value = getenv("P3HEAP_PAGES");
+
+    if (value == NULL) {
+        return P3HEAP_PAGES_NORMAL;
+    }
+    if (strcmp(value, "thp") == 0) {
+        return P3HEAP_PAGES_TRANSPARENT;
+    }
+    if (strcmp(value, "2m") == 0) {
+        return P3HEAP_PAGES_HUGE_2M;
+    }
+    if (strcmp(value, "1g") == 0) {
+        return P3HEAP_PAGES_HUGE_1G;
+    }
+    return P3HEAP_PAGES_NORMAL;
+}
+
+/* Sets up the heap, called once through pthread_once(). */
+static void shim_init() {
+
+    heapConfig config;
+
+    config.initial_size = env_size("P3HEAP_INITIAL", SHIM_INITIAL_SIZE);
+    config.max_size = env_size("P3HEAP_MAX", SHIM_MAX_SIZE);
+    config.grow_size = 0;
+    config.trim_threshold = P3HEAP_DEFAULT_TRIM;
+    config.mmap_threshold = P3HEAP_DEFAULT_MMAP;
+    config.placement = P3HEAP_GOOD_FIT;
+    config.isolate = env_size("P3HEAP_ISOLATE", 0) != 0;
+    config.pages = env_pages();
+
+    init_failed = init_heap_ex(&config) != 0;
+
+    // A child forked while another thread held a heap lock would
+    // deadlock on its first malloc().
+    if (!init_failed) {
+        pthread_atfork(heap_fork_prepare, heap_fork_parent, heap_fork_child);
+    }
+}
+
+/* Returns 0 once the heap is set up, -1 if it cannot be. */
+static int ensure_heap() {
+
+    pthread_once(&init_once, shim_init);
+    return init_failed ? -1 : 0;
+}
+
+/*
+ * Starts recording a trace when the library is loaded, if P3HEAP_TRACE is
+ * set.  Not done in shim_init(): the flusher thread cannot be created
+ * while the first malloc() call is still setting up the heap.
+ */
+__attribute__((constructor))
+static void shim_trace_start() {
+
+    const char *name = getenv("P3HEAP_TRACE");
+
+    if (name == NULL || *name == '\0' || ensure_heap() != 0) {
+        return;
+    }
+
+    char path[4096];
+    const char *pid = strstr(name, "%p");
+
+    if (pid != NULL) {
+        snprintf(path, sizeof(path), "%.*s%d%s", (int)(pid - name), name, (int)getpid(), pid + 2);
+        name = path;
+    }
+    heap_trace_start(name);
+}
+
+/* Writes out the rest of the trace when the process exits. */
+__attribute__((destructor))
+static void shim_trace_stop() {
+    heap_trace_stop();
+}
+
+/* malloc() itself, which also returns a unique pointer for size 0. */
+static void* shim_alloc(size_t size) {
+
+    if (ensure_heap() != 0) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    void *ptr = alloc(size == 0 ? 1 : size);
+
+    if (ptr == NULL) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+void* malloc(size_t size) {
+    return shim_alloc(size);
+}
+
+void free(void *ptr) {
+
+    if (ptr == NULL) {
+        return;
+    }
+    free_block(ptr);
+}
+
+/* C23 free_sized(), 'size' is what malloc() or calloc() was asked for. */
+void free_sized(void *ptr, size_t size) {
+
+    if (ptr == NULL) {
+        return;
+    }
+    free_block_sized(ptr, size == 0 ? 1 : size);
+}
+
+/* C23 free_aligned_sized(), for aligned_alloc() blocks. */
+void free_aligned_sized(void *ptr, size_t align, size_t size) {
+
+    (void)align;
+    free_sized(ptr, size);
+}
+
+void* calloc(size_t count, size_t size) {
+
+    if (size != 0 && count > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // Not malloc(), the compiler would turn malloc() + memset() into calloc().
+    void *ptr = shim_alloc(count * size);
+
+    if (ptr != NULL) {
+        memset(ptr, 0, count * size);
+    }
+    return ptr;
+}
+
+size_t malloc_usable_size(void *ptr) {
+
+    if (ptr == NULL) {
+        return 0;
+    }
+    return block_usable_size(ptr);
+}
+
+void* realloc(void *ptr, size_t size) {
+
+    if (ptr == NULL) {
+        return malloc(size);
+    }
+
+    if (size == 0) {
+        free(ptr);
+        return NULL;
+    }
+
+    void *resized = realloc_block(ptr, size);
+
+    if (resized == NULL) {
+        errno = ENOMEM;
+    }
+    return resized;
+}
+
+/* Allocates 'size' bytes aligned to 'align', a power of two. */
+static void* aligned_malloc(size_t align, size_t size) {
+
+    if (align <= MALLOC_ALIGNMENT) {
+        return malloc(size);
+    }
+
+    if (ensure_heap() != 0) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    void *ptr = alloc_aligned(size == 0 ? 1 : size, align);
+
+    if (ptr == NULL) {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+int posix_memalign(void **out, size_t align, size_t size) {
+
+    if (align < sizeof(void*) || (align & (align - 1)) != 0) {
+        return EINVAL;
+    }
+
+    void *ptr = aligned_malloc(align, size);
+
+    if (ptr == NULL) {
+        return ENOMEM;
+    }
+    *out = ptr;
+    return 0;
+}
+
+void* aligned_alloc(size_t align, size_t size) {
+
+    if (align == 0 || (align & (align - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return aligned_malloc(align, size);
+}
+
+void* memalign(size_t align, size_t size) {
+    return aligned_alloc(align, size);
+}
+
+void* valloc(size_t size) {
+    return aligned_malloc(getpagesize(), size);
+}
+
+void* pvalloc(size_t size) {
+
+    size_t pagesize = getpagesize();
+
+    if (size > SIZE_MAX - pagesize) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return aligned_malloc(pagesize, (size + pagesize - 1) & ~(pagesize - 1));
+}
@@ -0,0 +1,1123 @@
+/*
+ * Dhruv Butani - Heap Allocator - UW Madison CS354
+ *
+ * Regression checks for alloc(), free_block() and friends:
+ *
+ *   gcc -g -DP3HEAP_64BIT -pthread p3Heap.c p3Test.c -o p3test
+ *   ./p3test [check ...]
+ *
+ * Every check runs in a child process of its own, on a heap set up with
+ * the placement policy the check names, and heap_check() must return 0
+ * after each step.  With no arguments every check runs.
+ * Built with -DP3HEAP_DEBUG, like p3Heap.c, the checks that count on
+ * freed blocks being reused at once are left out and the debug mode's
+ * own checks are run instead.
+ * Exits with 1 if any check failed.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "p3Heap.h"
+
+// Built with AddressSanitizer, debug mode's poisoning reports bad writes
+// before the allocator can, so those are not made.
+#if defined(__SANITIZE_ADDRESS__)
+#define TEST_ASAN
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define TEST_ASAN
+#endif
+#endif
+
+/* Fails the running check when 'cond' is false. */
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            _exit(1); \
+        } \
+    } while (0)
+
+/* Seconds a check may take. */
+#define TEST_TIMEOUT 60
+
+typedef struct testCase {
+    const char *name;
+    placementPolicy placement;
+    void (*run)();
+    int own_heap;       // the check sets up the heap itself
+} testCase;
+
+/* Returns the next number of the generator in 'seed'. */
+static unsigned next_random(unsigned *seed) {
+
+    *seed = *seed * 1103515245 + 12345;
+    return *seed >> 8;
+}
+
+/* Fills the 'size' bytes of 'ptr' with a pattern of 'tag'. */
+static void fill_block(void *ptr, size_t size, unsigned tag) {
+
+    unsigned char *bytes = ptr;
+
+    for (size_t i = 0; i < size; i++) {
+        bytes[i] = (unsigned char)(tag + i);
+    }
+}
+
+/* Returns 1 if 'ptr' holds the first 'size' bytes of the fill of 'tag'. */
+static int block_filled(const void *ptr, size_t size, unsigned tag) {
+
+    const unsigned char *bytes = ptr;
+
+    for (size_t i = 0; i < size; i++) {
+        if (bytes[i] != (unsigned char)(tag + i)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Sets up the default heap with 'placement'. */
+static void start_heap(placementPolicy placement) {
+
+    heapConfig config;
+
+    config.initial_size = (size_t)1 << 20;
+    config.max_size = (size_t)256 << 20;
+    config.grow_size = 0;
+    config.trim_threshold = P3HEAP_DEFAULT_TRIM;
+    config.mmap_threshold = P3HEAP_DEFAULT_MMAP;
+    config.placement = placement;
+    config.isolate = 0;
+    config.pages = P3HEAP_PAGES_NORMAL;
+
+    CHECK(init_heap_ex(&config) == 0);
+}
+
+#ifndef P3HEAP_DEBUG
+/*
+ * Allocates all but a few bytes at the end of the heap, so that the next
+ * allocation has to reuse a hole, and next-fit has to wrap around.
+ */
+static void fill_heap() {
+
+    heapStats stats;
+
+    for (heap_stats(&stats); stats.largest_free >= 512; heap_stats(&stats)) {
+        size_t size = stats.largest_free - 256;
+        CHECK(alloc(size < 65536 ? size : 65536) != NULL);
+    }
+}
+
+/*
+ * free_batch() of a run of blocks the rover points into: reusing the hole
+ * at b leaves the rover on c, which the run swallows.
+ */
+static void test_batch_rover() {
+
+    char *d = alloc(100);
+    void *run[3] = { alloc(400), alloc(400), alloc(400) };
+
+    CHECK(d != NULL && run[0] != NULL && run[1] != NULL && run[2] != NULL);
+    fill_heap();
+    CHECK(free_block(run[1]) == 0);
+    CHECK(alloc(400) == run[1]);
+    CHECK(free_batch(run, 3) == 0);
+    CHECK(heap_check() == 0);
+
+    // Grows over the run in place, then allocates from the rover.
+    d = realloc_block(d, 1000);
+    CHECK(d != NULL);
+    memset(d, 0x5a, 1000);
+    CHECK(alloc(100) != NULL);
+    CHECK(heap_check() == 0);
+}
+#endif
+
+/*
+ * realloc_block() of a heap block past what its arena can reserve, which
+ * moves it to a large block.
+ */
+static void test_realloc_reserve() {
+
+    size_t size = (size_t)300 << 20;
+    char *ptr = alloc(1000);
+
+    CHECK(ptr != NULL);
+    memset(ptr, 0x5a, 1000);
+
+    char *moved = realloc_block(ptr, size);
+
+    CHECK(moved != NULL && moved != ptr);
+    CHECK(moved[0] == 0x5a && moved[999] == 0x5a);
+    CHECK(block_usable_size(moved) >= size);
+    moved[size - 1] = 1;
+    CHECK(heap_check() == 0);
+    CHECK(free_block(moved) == 0);
+    CHECK(heap_check() == 0);
+}
+
+static volatile int stop_threads;
+
+/* Holds the arena and large block locks as often as it can. */
+static void* lock_holder(void *arg) {
+
+    (void)arg;
+    while (!stop_threads) {
+        void *large = alloc((size_t)1 << 18);
+
+        CHECK(large != NULL);
+        CHECK(heap_check() == 0);
+        CHECK(free_block(large) == 0);
+    }
+    return NULL;
+}
+
+/*
+ * fork() while another thread holds allocator locks: with the handlers
+ * of heap_fork_prepare() registered the child can always allocate.
+ */
+static void test_fork() {
+
+    pthread_t thread;
+
+    CHECK(pthread_atfork(heap_fork_prepare, heap_fork_parent, heap_fork_child) == 0);
+    CHECK(pthread_create(&thread, NULL, lock_holder, NULL) == 0);
+
+    for (int i = 0; i < 200; i++) {
+        pid_t pid = fork();
+
+        CHECK(pid >= 0);
+        if (pid == 0) {
+            alarm(TEST_TIMEOUT);
+
+            void *large = alloc((size_t)1 << 18);
+            void *small = alloc(100);
+
+            CHECK(large != NULL && small != NULL);
+            CHECK(free_block(large) == 0 && free_block(small) == 0);
+            CHECK(heap_check() == 0);
+            _exit(0);
+        }
+
+        int status;
+
+        CHECK(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+
+    stop_threads = 1;
+    pthread_join(thread, NULL);
+    CHECK(heap_check() == 0);
+}
+
+#ifndef P3HEAP_DEBUG
+/*
+ * A heap from heap_create() is checked and counted on its own, and left
+ * out of heap_check() and heap_stats().
+ */
+static void test_handle_reports() {
+
+    heapConfig config = { (size_t)1 << 20, (size_t)64 << 20, 0, P3HEAP_DEFAULT_TRIM, 0,
+                          P3HEAP_GOOD_FIT, 0, P3HEAP_PAGES_NORMAL };
+    heap_t *h = heap_create(&config);
+    void *blocks[100];
+    heapStats before, stats;
+
+    CHECK(h != NULL);
+    heap_stats(&before);
+    for (int i = 0; i < 100; i++) {
+        blocks[i] = heap_alloc(h, i * 13 + 1);
+        CHECK(blocks[i] != NULL);
+    }
+    for (int i = 0; i < 100; i += 2) {
+        CHECK(heap_free(h, blocks[i]) == 0);
+    }
+    CHECK(heap_check_of(h) == 0);
+
+    heap_stats_of(h, &stats);
+    CHECK(stats.allocated_blocks == 50 && stats.alloc_calls == 100 && stats.free_calls == 50);
+    CHECK(stats.large_blocks == 0);
+    heap_stats(&stats);
+    CHECK(stats.allocated_blocks == before.allocated_blocks);
+
+    // A damaged header is reported for this heap, not for an arena.
+    unsigned char *low = (unsigned char*)blocks[1] - P3HEAP_ALIGNMENT / 2;
+
+    *low ^= 8;
+    CHECK(heap_check_of(h) == -1);
+    CHECK(heap_check() == 0);
+    *low ^= 8;
+    CHECK(heap_check_of(h) == 0);
+
+    heap_destroy(h);
+    CHECK(heap_check() == 0);
+}
+
+/*
+ * heap_stats() after a known sequence of allocs and frees of blocks too
+ * large for the thread cache, and of a large block.
+ */
+static void test_stats() {
+
+    void *blocks[10];
+    heapStats before, stats;
+
+    heap_stats(&before);
+    for (int i = 0; i < 10; i++) {
+        blocks[i] = alloc(1000);
+        CHECK(blocks[i] != NULL);
+    }
+    heap_stats(&stats);
+    CHECK(stats.alloc_calls == before.alloc_calls + 10);
+    CHECK(stats.allocated_blocks == before.allocated_blocks + 10);
+    CHECK(stats.allocated_bytes >= before.allocated_bytes + 10 * 1000);
+    CHECK(stats.splits == before.splits + 10);
+    CHECK(stats.heap_bytes == stats.allocated_bytes + stats.free_bytes);
+
+    // Five holes, none next to another free block.
+    for (int i = 0; i < 10; i += 2) {
+        CHECK(free_block(blocks[i]) == 0);
+    }
+    before = stats;
+    heap_stats(&stats);
+    CHECK(stats.free_calls == before.free_calls + 5);
+    CHECK(stats.free_blocks == before.free_blocks + 5);
+    CHECK(stats.allocated_blocks == before.allocated_blocks - 5);
+    CHECK(stats.coalesces == before.coalesces);
+    CHECK(stats.fragmentation > 0 && stats.fragmentation < 1);
+
+    // Joins the holes on both sides of it.
+    CHECK(free_block(blocks[1]) == 0);
+    before = stats;
+    heap_stats(&stats);
+    CHECK(stats.free_blocks == before.free_blocks - 1);
+    CHECK(stats.coalesces == before.coalesces + 2);
+    CHECK(stats.free_bytes == before.free_bytes + (before.allocated_bytes - stats.allocated_bytes));
+
+    // Within an eighth of the free block at the end of the heap, which
+    // holds all free bytes but those of the six blocks freed.
+    CHECK(stats.largest_free <= stats.free_bytes);
+    CHECK(stats.largest_free > (stats.free_bytes - 6 * 1100) / 8 * 7);
+
+    void *large = alloc(P3HEAP_DEFAULT_MMAP);
+
+    CHECK(large != NULL);
+    before = stats;
+    heap_stats(&stats);
+    CHECK(stats.large_blocks == before.large_blocks + 1);
+    CHECK(stats.large_bytes >= before.large_bytes + P3HEAP_DEFAULT_MMAP);
+    CHECK(stats.heap_bytes == before.heap_bytes);
+    CHECK(free_block(large) == 0);
+    heap_stats(&stats);
+    CHECK(stats.large_blocks == before.large_blocks);
+
+    // An alloc no mapping can hold fails and is counted.
+    CHECK(alloc(SIZE_MAX / 2) == NULL);
+    heap_stats(&stats);
+    CHECK(stats.failed_allocs == before.failed_allocs + 1);
+    CHECK(heap_check() == 0);
+}
+#endif
+
+/* Returns the sum of the 'n' counters at 'counts'. */
+static size_t profile_sum(const size_t *counts, int n) {
+
+    size_t sum = 0;
+
+    for (int i = 0; i < n; i++) {
+        sum += counts[i];
+    }
+    return sum;
+}
+
+/*
+ * Returns the count in 'profile' of the size class that holds a block for
+ * a request of 'size' bytes, one the class bounds of heap_class_size()
+ * put within a header and an alignment of it.
+ */
+static size_t profile_count(const heapProfile *profile, size_t size) {
+
+    for (int cls = 0; heap_class_size(cls + 1) != 0; cls++) {
+        if (heap_class_size(cls) <= size + 2 * P3HEAP_ALIGNMENT &&
+            heap_class_size(cls + 1) > size && profile->sizes[cls] != 0) {
+            return profile->sizes[cls];
+        }
+    }
+    return 0;
+}
+
+/*
+ * Histograms of a known sequence of calls, all of them timed, and no
+ * counting once profiling is off.
+ */
+static void test_profile() {
+
+    void *blocks[150];
+    heapProfile profile, later;
+
+    heap_profile_enable(1);
+    for (int i = 0; i < 150; i++) {
+        blocks[i] = alloc(i < 100 ? 40 : 3000);
+        CHECK(blocks[i] != NULL);
+    }
+    for (int i = 0; i < 150; i++) {
+        CHECK(free_block(blocks[i]) == 0);
+    }
+
+    heap_profile(&profile);
+    CHECK(profile_sum(profile.sizes, P3HEAP_SIZE_BUCKETS) == 150);
+    CHECK(profile_count(&profile, 40) == 100);
+    CHECK(profile_count(&profile, 3000) == 50);
+    CHECK(profile_sum(profile.alloc_ns, P3HEAP_LATENCY_BUCKETS) == 150);
+    CHECK(profile_sum(profile.free_ns, P3HEAP_LATENCY_BUCKETS) == 150);
+    CHECK(profile_sum(profile.walked, P3HEAP_WALK_BUCKETS) > 0);
+
+    heap_profile_enable(0);
+    CHECK(free_block(alloc(40)) == 0);
+    heap_profile(&later);
+    CHECK(memcmp(&profile, &later, sizeof(profile)) == 0);
+    CHECK(heap_check() == 0);
+}
+
+#define CHURN_SLOTS 2000
+
+/*
+ * Random allocs, aligned allocs, reallocs, frees, sized frees and batches
+ * of sizes from a few bytes to large blocks, with every block's contents
+ * checked before it is resized or freed.
+ */
+static void test_churn() {
+
+    static void *slots[CHURN_SLOTS];
+    static size_t sizes[CHURN_SLOTS];
+    unsigned seed = 42;
+
+    for (int op = 0; op < 200000; op++) {
+        unsigned r = next_random(&seed);
+        int k = r % CHURN_SLOTS;
+        size_t size = r % 8 == 0 ? next_random(&seed) % 300000 + 1 : next_random(&seed) % 600 + 1;
+
+        if (slots[k] == NULL) {
+            slots[k] = r % 5 == 0 ? alloc_aligned(size, (size_t)32 << (r % 4)) : alloc(size);
+            CHECK(slots[k] != NULL);
+            sizes[k] = size;
+            fill_block(slots[k], size, k);
+        } else if (r % 3 == 0) {
+            CHECK(block_filled(slots[k], sizes[k], k));
+
+            void *resized = realloc_block(slots[k], size);
+
+            CHECK(resized != NULL);
+            CHECK(block_filled(resized, sizes[k] < size ? sizes[k] : size, k));
+            slots[k] = resized;
+            sizes[k] = size;
+            fill_block(resized, size, k);
+        } else {
+            CHECK(block_filled(slots[k], sizes[k], k));
+            CHECK((r & 1 ? free_block_sized(slots[k], sizes[k]) : free_block(slots[k])) == 0);
+            slots[k] = NULL;
+        }
+
+        if (op % 20000 == 0) {
+            void *batch[64];
+            size_t got = alloc_batch(r % 200 + 1, 64, batch);
+
+            CHECK(got == 64);
+            CHECK(heap_check() == 0);
+            CHECK(free_batch(batch, got) == 0);
+            CHECK(heap_check() == 0);
+        }
+    }
+
+    for (int k = 0; k < CHURN_SLOTS; k++) {
+        if (slots[k] != NULL) {
+            CHECK(block_filled(slots[k], sizes[k], k));
+            CHECK(free_block(slots[k]) == 0);
+        }
+    }
+    CHECK(heap_check() == 0);
+    heap_trim();
+    CHECK(heap_check() == 0);
+}
+
+#define REMOTE_THREADS 4
+#define REMOTE_BLOCKS  2000
+
+static void *remote_blocks[REMOTE_THREADS][REMOTE_BLOCKS];
+static size_t remote_sizes[REMOTE_THREADS][REMOTE_BLOCKS];
+static pthread_barrier_t remote_barrier;
+
+/*
+ * Thread 'arg' of test_remote(): allocates blocks in its own arena, then
+ * resizes and frees the blocks of the next thread, each round.
+ */
+static void* remote_worker(void *arg) {
+
+    int id = (int)(intptr_t)arg;
+    int next = (id + 1) % REMOTE_THREADS;
+    unsigned seed = id + 1;
+
+    for (int round = 0; round < 20; round++) {
+        for (int i = 0; i < REMOTE_BLOCKS; i++) {
+            size_t size = next_random(&seed) % 500 + 1;
+
+            remote_blocks[id][i] = alloc(size);
+            CHECK(remote_blocks[id][i] != NULL);
+            remote_sizes[id][i] = size;
+            fill_block(remote_blocks[id][i], size, i);
+        }
+        pthread_barrier_wait(&remote_barrier);
+
+        for (int i = 0; i < REMOTE_BLOCKS; i++) {
+            void *ptr = remote_blocks[next][i];
+            size_t size = remote_sizes[next][i];
+
+            CHECK(block_filled(ptr, size, i));
+            if (i % 4 == 0) {
+                // Resized under the owner's lock, or moved to this arena.
+                ptr = realloc_block(ptr, size * 2);
+                CHECK(ptr != NULL && block_filled(ptr, size, i));
+                CHECK(free_block(ptr) == 0);
+            } else if (i % 4 == 1) {
+                CHECK(free_block_sized(ptr, size) == 0);
+            } else {
+                CHECK(free_block(ptr) == 0);
+            }
+        }
+        pthread_barrier_wait(&remote_barrier);
+
+        if (id == 0) {
+            CHECK(heap_check() == 0);
+        }
+        pthread_barrier_wait(&remote_barrier);
+    }
+    return NULL;
+}
+
+/*
+ * Blocks freed and resized by threads other than their arena's owner,
+ * which go through the owner's remote free stack and lock.
+ */
+static void test_remote() {
+
+    pthread_t threads[REMOTE_THREADS];
+
+    pthread_barrier_init(&remote_barrier, NULL, REMOTE_THREADS);
+    for (int i = 0; i < REMOTE_THREADS; i++) {
+        CHECK(pthread_create(&threads[i], NULL, remote_worker, (void*)(intptr_t)i) == 0);
+    }
+    for (int i = 0; i < REMOTE_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    // Every arena drains its remote frees on its next alloc().
+    CHECK(heap_check() == 0);
+    CHECK(free_block(alloc(8)) == 0);
+    CHECK(heap_check() == 0);
+}
+
+/* A list node in a heap file, linked by heap_offset(). */
+typedef struct fileNode {
+    size_t next;
+    unsigned value;
+} fileNode;
+
+/*
+ * A heap file written by one process and reopened by another, which
+ * follows the list left at its root and keeps allocating.
+ */
+static void test_file_heap() {
+
+    char path[64];
+    heapConfig config = { (size_t)1 << 20, (size_t)64 << 20, 0, P3HEAP_DEFAULT_TRIM, 0,
+                          P3HEAP_GOOD_FIT, 0, P3HEAP_PAGES_NORMAL };
+
+    snprintf(path, sizeof(path), "/dev/shm/p3test.%d", (int)getpid());
+    unlink(path);
+
+    pid_t pid = fork();
+
+    CHECK(pid >= 0);
+    if (pid == 0) {
+        alarm(TEST_TIMEOUT);
+        CHECK(init_heap_file(path, &config) == 0);
+
+        size_t head = 0;
+
+        for (unsigned i = 0; i < 1000; i++) {
+            fileNode *node = alloc(sizeof(fileNode) + i % 100);
+            void *garbage = alloc(i % 300 + 1);
+
+            CHECK(node != NULL && garbage != NULL);
+            node->next = head;
+            node->value = i;
+            head = heap_offset(node);
+            CHECK(free_block(garbage) == 0);
+        }
+        CHECK(heap_set_root(heap_pointer(head)) == 0);
+        CHECK(heap_check() == 0);
+        CHECK(heap_sync() == 0);
+        _exit(0);
+    }
+
+    int status;
+
+    CHECK(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    CHECK(reopen_heap_file(path, &config) == 0);
+    CHECK(heap_check() == 0);
+
+    unsigned expected = 1000;
+
+    for (fileNode *node = heap_root(); node != NULL;) {
+        fileNode *next = heap_pointer(node->next);
+
+        CHECK(node->value == --expected);
+        CHECK(free_block(node) == 0);
+        node = next;
+    }
+    CHECK(expected == 0);
+    CHECK(heap_set_root(NULL) == 0);
+    CHECK(heap_check() == 0);
+    CHECK(alloc(5000) != NULL);
+    CHECK(heap_check() == 0);
+    unlink(path);
+}
+
+#define POOL_OBJECTS 5000
+
+/*
+ * Objects allocated from a pool, freed ones reused first, and every chunk
+ * given back by pool_destroy().
+ */
+static void test_pool() {
+
+    static void *objects[POOL_OBJECTS];
+    objPool *pool = pool_create(24);
+
+    CHECK(pool != NULL);
+    for (int i = 0; i < POOL_OBJECTS; i++) {
+        objects[i] = pool_alloc(pool);
+        CHECK(objects[i] != NULL && (uintptr_t)objects[i] % P3HEAP_ALIGNMENT == 0);
+        fill_block(objects[i], 24, i);
+    }
+    CHECK(heap_check() == 0);
+
+    for (int i = 0; i < POOL_OBJECTS; i += 2) {
+        pool_free(pool, objects[i]);
+    }
+    for (int i = 1; i < POOL_OBJECTS; i += 2) {
+        CHECK(block_filled(objects[i], 24, i));
+    }
+
+    // The last object freed is the first one reused.
+    CHECK(pool_alloc(pool) == objects[POOL_OBJECTS - 2]);
+    pool_free(pool, NULL);
+    CHECK(heap_check() == 0);
+
+    pool_destroy(pool);
+    CHECK(heap_check() == 0);
+    CHECK(pool_create(0) == NULL);
+}
+
+#define REGION_ALLOCS 300
+
+/* Returns the size of allocation 'i' of test_region(). */
+static size_t region_size(int i) {
+    return i % 7 == 0 ? 10000 : (size_t)(i % 50 + 1);
+}
+
+/*
+ * A region filled past its first chunk, reset and filled again, which
+ * reuses its chunks and hands out the same memory.
+ */
+static void test_region() {
+
+    static char *first[REGION_ALLOCS];
+    memRegion *region = region_create(4096);
+
+    CHECK(region != NULL);
+    for (int round = 0; round < 3; round++) {
+        for (int i = 0; i < REGION_ALLOCS; i++) {
+            size_t size = region_size(i);
+            char *ptr = region_alloc(region, size);
+
+            CHECK(ptr != NULL && (uintptr_t)ptr % P3HEAP_ALIGNMENT == 0);
+            CHECK(round == 0 || ptr == first[i]);
+            first[i] = ptr;
+            fill_block(ptr, size, i);
+        }
+        for (int i = 0; i < REGION_ALLOCS; i++) {
+            CHECK(block_filled(first[i], region_size(i), i));
+        }
+        CHECK(heap_check() == 0);
+        region_reset(region);
+    }
+
+    region_destroy(region);
+    CHECK(heap_check() == 0);
+}
+
+/* Output of heap_dump_to(), collected by dump_collect(). */
+typedef struct dumpBuffer {
+    char *data;
+    size_t used;
+    size_t size;
+} dumpBuffer;
+
+/* heapDumpWriter that appends to the dumpBuffer 'arg'. */
+static int dump_collect(void *arg, const void *data, size_t size) {
+
+    dumpBuffer *buffer = arg;
+
+    if (buffer->used + size > buffer->size) {
+        buffer->size = (buffer->used + size) * 2;
+        buffer->data = realloc(buffer->data, buffer->size);
+        CHECK(buffer->data != NULL);
+    }
+    memcpy(buffer->data + buffer->used, data, size);
+    buffer->used += size;
+    return 0;
+}
+
+/*
+ * Reads a binary dump into 'buffer' and returns the number of arenas in
+ * its header, after checking the header.
+ */
+static uint32_t dump_binary(dumpBuffer *buffer) {
+
+    heapDumpHeader header;
+
+    buffer->used = 0;
+    CHECK(heap_dump_to(dump_collect, buffer, P3HEAP_DUMP_BINARY) == 0);
+    CHECK(buffer->used >= sizeof(header));
+    memcpy(&header, buffer->data, sizeof(header));
+    CHECK(memcmp(header.magic, P3HEAP_DUMP_MAGIC, 4) == 0);
+    CHECK(header.version == P3HEAP_DUMP_VERSION);
+    return header.arenas;
+}
+
+/*
+ * A binary dump parsed back: every arena's blocks tile its heap and add
+ * up to its counters and to heap_stats(), and the large blocks follow.
+ * The JSON dump has the same arenas.
+ */
+static void test_dump() {
+
+    char *a = alloc(500), *b = alloc(777), *c = alloc(500);
+    void *large = alloc(P3HEAP_DEFAULT_MMAP);
+    dumpBuffer buffer = { NULL, 0, 0 };
+    heapStats stats;
+
+    CHECK(a != NULL && b != NULL && c != NULL && large != NULL);
+    CHECK(free_block(a) == 0);
+
+    uint32_t arenas = dump_binary(&buffer);
+    size_t at = sizeof(heapDumpHeader);
+    uint64_t heapBytes = 0, freeBytes = 0, freeBlocks = 0;
+    int holeBeforeB = 0;
+
+    CHECK(arenas >= 1);
+    for (uint32_t i = 0; i < arenas; i++) {
+        heapDumpArena arena;
+        uint64_t offset = 0, freeSize = 0, freeCount = 0, largest = 0;
+
+        CHECK(buffer.used >= at + sizeof(arena));
+        memcpy(&arena, buffer.data + at, sizeof(arena));
+        at += sizeof(arena);
+        CHECK(arena.index == i);
+        CHECK(buffer.used >= at + arena.blocks * sizeof(heapDumpBlock));
+
+        heapDumpBlock *blocks = (heapDumpBlock*)(buffer.data + at);
+
+        for (uint64_t j = 0; j < arena.blocks; j++) {
+            uint64_t size = blocks[j].size_status & ~(uint64_t)7;
+            int allocated = blocks[j].size_status & 1;
+
+            CHECK(blocks[j].offset == offset && size != 0);
+            CHECK(j == 0 || ((blocks[j].size_status >> 1) & 1) == (blocks[j - 1].size_status & 1));
+            if (!allocated) {
+                freeSize += size;
+                freeCount++;
+                largest = size > largest ? size : largest;
+            }
+            if (j > 0 && allocated && (blocks[j - 1].size_status & 1) == 0 &&
+                size >= 777 && size <= 777 + 2 * P3HEAP_ALIGNMENT) {
+                holeBeforeB = 1;
+            }
+            offset += size;
+        }
+        CHECK(offset == arena.heap_bytes);
+        CHECK(freeSize == arena.free_bytes && freeCount == arena.free_blocks);
+        CHECK(largest == arena.largest_free);
+        heapBytes += arena.heap_bytes;
+        freeBytes += freeSize;
+        freeBlocks += freeCount;
+        at += arena.blocks * sizeof(heapDumpBlock);
+    }
+#ifndef P3HEAP_DEBUG
+    // Debug mode keeps a in the quarantine.
+    CHECK(holeBeforeB);
+#else
+    (void)holeBeforeB;
+#endif
+
+    heapDumpArena last;
+    heapDumpBlock *blocks = (heapDumpBlock*)(buffer.data + at + sizeof(last));
+    int foundLarge = 0;
+
+    CHECK(buffer.used >= at + sizeof(last));
+    memcpy(&last, buffer.data + at, sizeof(last));
+    CHECK(last.index == UINT32_MAX);
+    CHECK(buffer.used == at + sizeof(last) + last.blocks * sizeof(heapDumpBlock));
+    for (uint64_t j = 0; j < last.blocks; j++) {
+        CHECK((blocks[j].size_status & 5) == 5);
+        if ((blocks[j].size_status & ~(uint64_t)7) >= P3HEAP_DEFAULT_MMAP) {
+            foundLarge = 1;
+        }
+    }
+    CHECK(foundLarge);
+
+    heap_stats(&stats);
+    CHECK(heapBytes == stats.heap_bytes && freeBytes == stats.free_bytes);
+    CHECK(freeBlocks == stats.free_blocks);
+    CHECK(last.blocks == stats.large_blocks && last.heap_bytes == stats.large_bytes);
+
+    // JSON of the same heap, through heap_dump().
+    FILE *file = tmpfile();
+    char text[64];
+
+    CHECK(file != NULL);
+    CHECK(heap_dump(fileno(file), P3HEAP_DUMP_JSON) == 0);
+    CHECK(heap_dump(fileno(file), 7) == -1);
+    free(buffer.data);
+    buffer.data = NULL;
+    buffer.used = buffer.size = 0;
+    rewind(file);
+    for (size_t n; (n = fread(text, 1, sizeof(text), file)) > 0;) {
+        dump_collect(&buffer, text, n);
+    }
+    fclose(file);
+    dump_collect(&buffer, "", 1);       // terminates the text
+
+    uint32_t objects = 0;
+
+    for (char *next = buffer.data; (next = strstr(next, "{\"index\":")) != NULL; next++) {
+        objects++;
+    }
+    CHECK(strncmp(buffer.data, "{\"arenas\":[{\"index\":0,", 22) == 0);
+    CHECK(objects == arenas);
+    CHECK(strstr(buffer.data, "],\"large\":{\"bytes\":") != NULL);
+    CHECK(strcmp(buffer.data + buffer.used - 5, "]}}\n") == 0);
+    free(buffer.data);
+
+    CHECK(free_block(b) == 0 && free_block(c) == 0 && free_block(large) == 0);
+    CHECK(heap_check() == 0);
+}
+
+#define TRACE_CALLS 8
+
+/*
+ * A trace recorded and read back: its header, one record per call in
+ * call order with the sizes asked for, then the calls replayed on the
+ * heap with the recorded pointers mapped to the new blocks.
+ */
+static void test_trace() {
+
+    static const uint32_t ops[TRACE_CALLS] = {
+        P3HEAP_TRACE_ALLOC, P3HEAP_TRACE_ALLOC, P3HEAP_TRACE_ALLOC, P3HEAP_TRACE_REALLOC,
+        P3HEAP_TRACE_ALLOC, P3HEAP_TRACE_FREE, P3HEAP_TRACE_FREE, P3HEAP_TRACE_FREE
+    };
+    static const size_t sizes[TRACE_CALLS] = { 100, 10, 300, 5000, 64, 0, 0, 0 };
+    char path[64];
+    void *ptrs[TRACE_CALLS];
+
+    snprintf(path, sizeof(path), "/tmp/p3test.%d.trace", (int)getpid());
+    CHECK(heap_trace_start(path) == 0);
+    CHECK(heap_trace_start(path) == -1);
+
+    ptrs[0] = alloc(100);
+    ptrs[1] = alloc_isolated(10);
+    ptrs[2] = alloc_aligned(300, 256);
+    ptrs[3] = realloc_block(ptrs[0], 5000);
+    ptrs[4] = alloc(64);
+    CHECK(free_block(ptrs[3]) == 0);
+    CHECK(free_block_sized(ptrs[1], 10) == 0);
+    CHECK(free_block(ptrs[2]) == 0);
+    ptrs[5] = ptrs[3];
+    ptrs[6] = ptrs[1];
+    ptrs[7] = ptrs[2];
+    CHECK(heap_trace_stop() == 0);
+    CHECK(heap_trace_stop() == 0);
+
+    // Not recorded, the trace is stopped.
+    CHECK(free_block(ptrs[4]) == 0);
+
+    FILE *file = fopen(path, "rb");
+    heapTraceHeader header;
+    heapTraceRecord records[TRACE_CALLS + 1];
+
+    CHECK(file != NULL);
+    CHECK(fread(&header, sizeof(header), 1, file) == 1);
+    CHECK(memcmp(header.magic, P3HEAP_TRACE_MAGIC, 4) == 0);
+    CHECK(header.version == P3HEAP_TRACE_VERSION);
+    CHECK(header.record_size == sizeof(heapTraceRecord));
+    CHECK(fread(records, sizeof(heapTraceRecord), TRACE_CALLS + 1, file) == TRACE_CALLS);
+    fclose(file);
+    unlink(path);
+
+    for (int i = 0; i < TRACE_CALLS; i++) {
+        CHECK(records[i].op == ops[i] && records[i].size == sizes[i]);
+        CHECK(records[i].ptr == (uintptr_t)ptrs[i] && records[i].ptr != 0);
+        CHECK(records[i].thread == records[0].thread);
+        CHECK(i == 0 || records[i].time_ns >= records[i - 1].time_ns);
+    }
+    CHECK(records[3].old == (uintptr_t)ptrs[0]);
+
+    // Replayed as p3Bench does: each recorded block stands for the block
+    // its replayed call returned.
+    for (int round = 0; round < 100; round++) {
+        void *replayed[TRACE_CALLS];
+
+        for (int i = 0; i < TRACE_CALLS; i++) {
+            int from = -1;
+
+            for (int j = 0; j < i; j++) {
+                uint64_t recorded = records[i].op == P3HEAP_TRACE_REALLOC ? records[i].old
+                                                                          : records[i].ptr;
+                if (records[j].ptr == recorded && records[j].op != P3HEAP_TRACE_FREE) {
+                    from = j;
+                }
+            }
+            if (records[i].op == P3HEAP_TRACE_ALLOC) {
+                replayed[i] = alloc(records[i].size);
+                CHECK(replayed[i] != NULL);
+            } else if (records[i].op == P3HEAP_TRACE_REALLOC) {
+                CHECK(from >= 0);
+                replayed[i] = realloc_block(replayed[from], records[i].size);
+                CHECK(replayed[i] != NULL);
+            } else {
+                CHECK(from >= 0);
+                CHECK(free_block(replayed[from]) == 0);
+                replayed[i] = NULL;
+            }
+        }
+        CHECK(free_block(replayed[4]) == 0);
+        CHECK(heap_check() == 0);
+    }
+}
+
+#define NUMA_THREADS 3
+
+// get_mempolicy() modes, as in <numaif.h>.
+#define TEST_MPOL_DEFAULT   0
+#define TEST_MPOL_PREFERRED 1
+#define TEST_MPOL_F_ADDR    2
+
+static pthread_barrier_t numa_barrier;
+
+/*
+ * Thread of test_numa(): allocates in an arena of its own and checks the
+ * memory policy of its region, holding on to the arena until every thread
+ * has one.
+ */
+static void* numa_worker(void *arg) {
+
+    char *block = alloc(1000);
+    int mode = -1;
+    unsigned long mask = 0;
+
+    (void)arg;
+    CHECK(block != NULL);
+    memset(block, 1, 1000);
+
+    // Where the O.S. does not let the policy be read there is nothing
+    // to check it against.
+    if (syscall(SYS_get_mempolicy, &mode, &mask, 8 * sizeof(mask), block, TEST_MPOL_F_ADDR) == 0) {
+        if (access("/sys/devices/system/node/node1", F_OK) == 0) {
+            // Preferred on the one node the thread ran on.
+            CHECK(mode == TEST_MPOL_PREFERRED);
+            CHECK(mask != 0 && (mask & (mask - 1)) == 0);
+        } else {
+            CHECK(mode == TEST_MPOL_DEFAULT);
+        }
+    }
+
+    pthread_barrier_wait(&numa_barrier);
+    pthread_barrier_wait(&numa_barrier);
+    CHECK(free_block(block) == 0);
+    return NULL;
+}
+
+/*
+ * Threads allocating at once get an arena each, bound to the NUMA node
+ * they run on when there are several.
+ */
+static void test_numa() {
+
+    pthread_t threads[NUMA_THREADS];
+    dumpBuffer buffer = { NULL, 0, 0 };
+    void *own = alloc(100);
+
+    CHECK(own != NULL);
+    pthread_barrier_init(&numa_barrier, NULL, NUMA_THREADS + 1);
+    for (int i = 0; i < NUMA_THREADS; i++) {
+        CHECK(pthread_create(&threads[i], NULL, numa_worker, NULL) == 0);
+    }
+
+    pthread_barrier_wait(&numa_barrier);
+    CHECK(dump_binary(&buffer) == NUMA_THREADS + 1);
+    CHECK(heap_check() == 0);
+    pthread_barrier_wait(&numa_barrier);
+
+    for (int i = 0; i < NUMA_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(buffer.data);
+    CHECK(free_block(own) == 0);
+    CHECK(heap_check() == 0);
+}
+
+#ifdef P3HEAP_DEBUG
+/*
+ * Debug mode: overruns, double frees, wrong sizes and writes after free
+ * are caught, and the heap stays consistent around the damaged blocks.
+ */
+static void test_debug() {
+
+    char *over = alloc(10);
+
+    CHECK(over != NULL && block_usable_size(over) == 10);
+#ifndef TEST_ASAN
+    ((volatile char*)over)[10] = 'x';
+    CHECK(free_block(over) == -1);
+    CHECK(heap_check() == 0);
+#endif
+
+    char *twice = alloc(33);
+
+    CHECK(free_block(twice) == 0);
+    CHECK(free_block(twice) == -1);
+    CHECK(heap_check() == 0);
+
+    char *sized = alloc(64);
+
+    CHECK(free_block_sized(sized, 63) == -1);
+    CHECK(free_block_sized(sized, 64) == 0);
+
+    // Isolated blocks are rounded up to whole lines, but still freed as
+    // the size asked for.
+    char *isolated = alloc_isolated(10);
+
+    CHECK(isolated != NULL && (uintptr_t)isolated % P3HEAP_CACHE_LINE == 0);
+    CHECK(block_usable_size(isolated) == 10);
+    CHECK(free_block_sized(isolated, 10) == 0);
+    CHECK(heap_check() == 0);
+
+    // Written after free, then pushed out of the quarantine.
+    char *stale = alloc(48);
+
+    CHECK(free_block(stale) == 0);
+#ifndef TEST_ASAN
+    ((volatile char*)stale)[5] = 7;
+#endif
+    for (int i = 0; i < 5000; i++) {
+        CHECK(free_block(alloc(i % 300 + 1)) == 0);
+    }
+    CHECK(heap_check() == 0);
+
+    char *moved = alloc(5);
+
+    memcpy(moved, "abcd", 5);
+    char *grown = realloc_block(moved, 1000);
+    CHECK(grown != NULL && grown != moved && strcmp(grown, "abcd") == 0);
+    CHECK(free_block(moved) == -1);
+    CHECK(free_block(grown) == 0);
+    CHECK(heap_check() == 0);
+}
+#endif
+
+static const testCase tests[] = {
+#ifndef P3HEAP_DEBUG
+    { "batch-rover-good", P3HEAP_GOOD_FIT, test_batch_rover, 0 },
+    { "batch-rover-next", P3HEAP_NEXT_FIT, test_batch_rover, 0 },
+    { "handle-reports", P3HEAP_GOOD_FIT, test_handle_reports, 0 },
+    { "stats", P3HEAP_GOOD_FIT, test_stats, 0 },
+#else
+    { "debug", P3HEAP_GOOD_FIT, test_debug, 0 },
+#endif
+    { "realloc-reserve", P3HEAP_GOOD_FIT, test_realloc_reserve, 0 },
+    { "fork", P3HEAP_GOOD_FIT, test_fork, 0 },
+    { "churn-good", P3HEAP_GOOD_FIT, test_churn, 0 },
+    { "churn-first", P3HEAP_FIRST_FIT, test_churn, 0 },
+    { "churn-next", P3HEAP_NEXT_FIT, test_churn, 0 },
+    { "churn-best", P3HEAP_BEST_FIT, test_churn, 0 },
+    { "remote", P3HEAP_GOOD_FIT, test_remote, 0 },
+    { "file-heap", P3HEAP_GOOD_FIT, test_file_heap, 1 },
+    { "pool", P3HEAP_GOOD_FIT, test_pool, 0 },
+    { "region", P3HEAP_GOOD_FIT, test_region, 0 },
+    { "profile", P3HEAP_GOOD_FIT, test_profile, 0 },
+    { "dump", P3HEAP_GOOD_FIT, test_dump, 0 },
+    { "trace", P3HEAP_GOOD_FIT, test_trace, 0 },
+    { "numa", P3HEAP_GOOD_FIT, test_numa, 0 },
+};
+
+#define NUM_TESTS (sizeof(tests) / sizeof(tests[0]))
+
+/* Runs 'test' in a child process, returns 0 if it passed. */
+static int run_test(const testCase *test) {
+
+    fflush(stdout);
+
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        // A deadlock fails the check instead of hanging.
+        alarm(TEST_TIMEOUT);
+        if (!test->own_heap) {
+            start_heap(test->placement);
+        }
+        test->run();
+        _exit(0);
+    }
+
+    int status;
+
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        printf("FAIL  %s\n", test->name);
+        return -1;
+    }
+    printf("ok    %s\n", test->name);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+
+    int failed = 0;
+
+    for (size_t i = 0; i < NUM_TESTS; i++) {
+        int wanted = argc < 2;
+
+        for (int j = 1; j < argc && !wanted; j++) {
+            wanted = strcmp(argv[j], tests[i].name) == 0;
+        }
+        if (wanted && run_test(&tests[i]) != 0) {
+            failed++;
+        }
+    }
+
+    if (failed != 0) {
+        printf("%d failed\n", failed);
+    }
+    return failed != 0;
+}
@@ -0,0 +1,232 @@
+/*
+ * Dhruv Butani - Heap Allocator - UW Madison CS354
+ *
+ * Checks of p3Heap.hpp, every allocator and memory resource instantiated
+ * with std and pmr containers:
+ *
+ *   gcc -c -g -DP3HEAP_64BIT p3Heap.c -o p3Heap.o
+ *   g++ -std=c++17 -g -DP3HEAP_64BIT -pthread p3TestHpp.cpp p3Heap.o -o p3testhpp
+ *   ./p3testhpp
+ *
+ * heap_check(), or heap_check_of() for a heap of its own, must return 0
+ * after each step.  Exits with 1 if a check failed.
+ */
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <list>
+#include <memory_resource>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "p3Heap.hpp"
+
+/* Fails the checks when 'cond' is false. */
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            std::exit(1); \
+        } \
+    } while (0)
+
+/* A type aligned beyond what every payload gets. */
+struct alignas(64) Line {
+    char bytes[64];
+};
+
+/* Returns a configuration of a heap of its own, of at most 'max' bytes. */
+static heapConfig own_config(std::size_t max) {
+    return heapConfig{ (std::size_t)1 << 20, max, 0, P3HEAP_DEFAULT_TRIM, 0,
+                       P3HEAP_GOOD_FIT, 0, P3HEAP_PAGES_NORMAL };
+}
+
+/* PoolAllocator: vectors, node containers and over-aligned types. */
+static void test_pool_allocator() {
+
+    std::vector<int, p3heap::PoolAllocator<int>> numbers;
+
+    for (int i = 0; i < 10000; i++) {
+        numbers.push_back(i);
+    }
+    CHECK(numbers[9999] == 9999);
+
+    // Every node is allocated and freed one at a time, by its size.
+    std::list<long, p3heap::PoolAllocator<long>> nodes;
+
+    for (long i = 0; i < 1000; i++) {
+        nodes.push_back(i);
+    }
+    nodes.remove_if([](long n) { return n % 3 == 0; });
+    CHECK(nodes.size() == 666);
+
+    static_assert(p3heap::PoolAllocator<Line>::over_aligned, "Line takes the aligned path");
+    std::vector<Line, p3heap::PoolAllocator<Line>> lines(100);
+
+    CHECK(reinterpret_cast<std::uintptr_t>(lines.data()) % alignof(Line) == 0);
+    CHECK(p3heap::PoolAllocator<int>() == p3heap::PoolAllocator<Line>());
+    CHECK(heap_check() == 0);
+
+    bool thrown = false;
+
+    try {
+        p3heap::PoolAllocator<Line>().allocate(static_cast<std::size_t>(-1) / 2);
+    } catch (const std::bad_alloc&) {
+        thrown = true;
+    }
+    CHECK(thrown);
+}
+
+/* HeapAllocator: containers of two heaps, moved and swapped between them. */
+static void test_heap_allocator() {
+
+    heapConfig config = own_config((std::size_t)64 << 20);
+    heap_t *first = heap_create(&config);
+    heap_t *second = heap_create(&config);
+
+    CHECK(first != nullptr && second != nullptr);
+    {
+        p3heap::HeapVector<int> a{p3heap::HeapAllocator<int>(first)};
+        p3heap::HeapVector<int> b{p3heap::HeapAllocator<int>(second)};
+        p3heap::HeapUnorderedMap<int, std::string> map{
+            16, std::hash<int>(), std::equal_to<int>(),
+            p3heap::HeapAllocator<std::pair<const int, std::string>>(first)};
+
+        for (int i = 0; i < 5000; i++) {
+            a.push_back(i);
+            map.emplace(i, std::to_string(i));
+        }
+        b.push_back(-1);
+        CHECK(map.at(4321) == "4321");
+
+        // The allocator follows the memory on move assignment and swap.
+        p3heap::HeapVector<int> c{p3heap::HeapAllocator<int>(second)};
+
+        c.push_back(7);
+        b = std::move(a);
+        CHECK(b.get_allocator().heap() == first && b.size() == 5000);
+        c.swap(b);
+        CHECK(c.get_allocator().heap() == first && c[4999] == 4999);
+        CHECK(b.get_allocator().heap() == second && b[0] == 7);
+        CHECK(b.get_allocator() != c.get_allocator());
+        CHECK(heap_check_of(first) == 0 && heap_check_of(second) == 0);
+
+        std::vector<Line, p3heap::HeapAllocator<Line>> lines(10, Line(),
+                                                             p3heap::HeapAllocator<Line>(second));
+
+        CHECK(reinterpret_cast<std::uintptr_t>(lines.data()) % alignof(Line) == 0);
+    }
+    CHECK(heap_check_of(first) == 0 && heap_check_of(second) == 0);
+
+#ifndef P3HEAP_DEBUG
+    // Every block went back; debug mode keeps them in the quarantine.
+    heapStats stats;
+
+    heap_stats_of(first, &stats);
+    CHECK(stats.allocated_blocks == 0);
+#endif
+
+    heap_destroy(first);
+    heap_destroy(second);
+
+    // A heap too small for the request throws.
+    heapConfig small = own_config((std::size_t)1 << 20);
+    heap_t *h = heap_create(&small);
+    bool thrown = false;
+
+    CHECK(h != nullptr);
+    try {
+        p3heap::HeapVector<char> big{p3heap::HeapAllocator<char>(h)};
+
+        big.resize((std::size_t)2 << 20);
+    } catch (const std::bad_alloc&) {
+        thrown = true;
+    }
+    CHECK(thrown);
+    CHECK(heap_check_of(h) == 0);
+    heap_destroy(h);
+    CHECK(heap_check() == 0);
+}
+
+/* RegionAllocator: containers filled, dropped and the region reset. */
+static void test_region_allocator() {
+
+    memRegion *region = region_create(4096);
+
+    CHECK(region != nullptr);
+    for (int round = 0; round < 3; round++) {
+        p3heap::RegionVector<int> numbers{p3heap::RegionAllocator<int>(region)};
+        p3heap::RegionUnorderedMap<int, int> squares{
+            16, std::hash<int>(), std::equal_to<int>(),
+            p3heap::RegionAllocator<std::pair<const int, int>>(region)};
+
+        for (int i = 0; i < 2000; i++) {
+            numbers.push_back(i);
+            squares[i] = i * i;
+        }
+        CHECK(numbers[1999] == 1999 && squares.at(1000) == 1000000);
+        CHECK(heap_check() == 0);
+        numbers = p3heap::RegionVector<int>{p3heap::RegionAllocator<int>(region)};
+        squares.clear();
+        region_reset(region);
+    }
+    region_destroy(region);
+    CHECK(heap_check() == 0);
+}
+
+/* HeapResource and default_resource() under pmr containers. */
+static void test_resources() {
+
+    heapConfig config = own_config((std::size_t)64 << 20);
+    heap_t *h = heap_create(&config);
+
+    CHECK(h != nullptr);
+    {
+        p3heap::HeapResource resource(h);
+        p3heap::HeapResource same(h);
+        std::pmr::unordered_map<int, std::pmr::string> cache(&resource);
+
+        for (int i = 0; i < 2000; i++) {
+            cache.emplace(i, std::pmr::string(100, static_cast<char>('a' + i % 26)));
+        }
+        CHECK(cache.at(27)[99] == 'b');
+        CHECK(resource.is_equal(same) && !resource.is_equal(*p3heap::default_resource()));
+
+        void *aligned = resource.allocate(100, 256);
+
+        CHECK(reinterpret_cast<std::uintptr_t>(aligned) % 256 == 0);
+        resource.deallocate(aligned, 100, 256);
+        CHECK(heap_check_of(h) == 0);
+    }
+    CHECK(heap_check_of(h) == 0);
+    heap_destroy(h);
+
+    std::pmr::vector<std::pmr::string> words(p3heap::default_resource());
+
+    for (int i = 0; i < 1000; i++) {
+        words.emplace_back(std::to_string(i) + " is a string too long for small string storage");
+    }
+    CHECK(words[500].compare(0, 3, "500") == 0);
+
+    void *empty = p3heap::default_resource()->allocate(0, 8);
+
+    CHECK(empty != nullptr);
+    p3heap::default_resource()->deallocate(empty, 0, 8);
+    CHECK(heap_check() == 0);
+}
+
+int main() {
+
+    CHECK(init_heap(1 << 20) == 0);
+
+    test_pool_allocator();
+    std::printf("ok    pool-allocator\n");
+    test_heap_allocator();
+    std::printf("ok    heap-allocator\n");
+    test_region_allocator();
+    std::printf("ok    region-allocator\n");
+    test_resources();
+    std::printf("ok    resources\n");
+    return 0;
+}